@@ -0,0 +1,684 @@
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "thread.h"
+#ifdef __cpp_impl_coroutine
+#include "thread_task.h"
+#endif
+using namespace std;
+
+typedef unsigned int Mutex;    // mutex lock
+typedef unsigned int CondVar;  // conditional variable
+
+// Every benchmark runs in the main thread, one after another. Threads it creates report to it through
+// lockDone/cvDone when they finish.
+Mutex lockDone = 0x1;
+Mutex lockBench = 0x2;
+CondVar cvDone = 0x1;
+CondVar cvPing = 0x2;
+CondVar cvPong = 0x3;
+CondVar cvFanOut = 0x4;
+CondVar cvAck = 0x5;
+
+// The *_emulated benchmarks build the same primitives out of lockEmulation and these CVs.
+Mutex lockEmulation = 0x3;
+CondVar cvRead = 0x6;
+CondVar cvWrite = 0x7;
+CondVar cvSem = 0x8;  // and 0x9, one per semaphore
+CondVar cvBarrier = 0xa;
+unsigned int rwBench = 0x1;
+unsigned int semPing = 0x1;
+unsigned int semPong = 0x2;
+unsigned int barrierBench = 0x1;
+unsigned int poolBench = 0x1;
+
+long iterations = 100000;
+unsigned int quantum = 0;  // thread_set_quantum(), 0 for none
+int running = 0;  // threads of the current benchmark not finished yet
+int turn = 0;     // ping-pong: whose turn it is
+long generation = 0;
+int acknowledged = 0;
+bool native = true;  // native primitives, or the emulation
+bool stopYielding = false;
+
+int emulatedReaders = 0;
+int emulatedWritersWaiting = 0;
+bool emulatedWriter = false;
+unsigned int emulatedSem[2];
+int emulatedArrived = 0;
+int barrierThreads = 0;
+
+//////////
+// TOOL //
+//////////
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Create count threads running func(arg), to be waited for with joinAll().
+static void spawn(int count, thread_startfunc_t func, void* arg) {
+    thread_lock(lockDone);
+    running += count;
+    thread_unlock(lockDone);
+    for (int i = 0; i < count; i++) {
+        thread_create(func, arg);
+    }
+}
+
+static void finished() {
+    thread_lock(lockDone);
+    running--;
+    thread_signal(lockDone, cvDone);
+    thread_unlock(lockDone);
+}
+
+static void joinAll() {
+    thread_lock(lockDone);
+    while (running > 0) {
+        thread_wait(lockDone, cvDone);
+    }
+    thread_unlock(lockDone);
+}
+
+///////////////
+// EMULATION //
+///////////////
+
+// Writer-preferring, like the native default.
+static void readLock() {
+    if (native) {
+        thread_rwlock_rdlock(rwBench);
+        return;
+    }
+    thread_lock(lockEmulation);
+    while (emulatedWriter || emulatedWritersWaiting > 0) {
+        thread_wait(lockEmulation, cvRead);
+    }
+    emulatedReaders++;
+    thread_unlock(lockEmulation);
+}
+
+static void readUnlock() {
+    if (native) {
+        thread_rwlock_unlock(rwBench);
+        return;
+    }
+    thread_lock(lockEmulation);
+    emulatedReaders--;
+    if (emulatedReaders == 0) {
+        thread_signal(lockEmulation, cvWrite);
+    }
+    thread_unlock(lockEmulation);
+}
+
+static void writeLock() {
+    if (native) {
+        thread_rwlock_wrlock(rwBench);
+        return;
+    }
+    thread_lock(lockEmulation);
+    emulatedWritersWaiting++;
+    while (emulatedWriter || emulatedReaders > 0) {
+        thread_wait(lockEmulation, cvWrite);
+    }
+    emulatedWritersWaiting--;
+    emulatedWriter = true;
+    thread_unlock(lockEmulation);
+}
+
+static void writeUnlock() {
+    if (native) {
+        thread_rwlock_unlock(rwBench);
+        return;
+    }
+    thread_lock(lockEmulation);
+    emulatedWriter = false;
+    if (emulatedWritersWaiting > 0) {
+        thread_signal(lockEmulation, cvWrite);
+    } else {
+        thread_broadcast(lockEmulation, cvRead);
+    }
+    thread_unlock(lockEmulation);
+}
+
+static void semWait(unsigned int sem) {
+    if (native) {
+        thread_sem_wait(sem);
+        return;
+    }
+    thread_lock(lockEmulation);
+    while (emulatedSem[sem - 1] == 0) {
+        thread_wait(lockEmulation, cvSem + sem - 1);
+    }
+    emulatedSem[sem - 1]--;
+    thread_unlock(lockEmulation);
+}
+
+static void semPost(unsigned int sem) {
+    if (native) {
+        thread_sem_post(sem);
+        return;
+    }
+    thread_lock(lockEmulation);
+    emulatedSem[sem - 1]++;
+    thread_signal(lockEmulation, cvSem + sem - 1);
+    thread_unlock(lockEmulation);
+}
+
+static void barrierWait() {
+    if (native) {
+        thread_barrier_wait(barrierBench);
+        return;
+    }
+    thread_lock(lockEmulation);
+    emulatedArrived++;
+    if (emulatedArrived == barrierThreads) {
+        emulatedArrived = 0;
+        generation++;
+        thread_broadcast(lockEmulation, cvBarrier);
+    } else {
+        long seen = generation;
+        while (generation == seen) {
+            thread_wait(lockEmulation, cvBarrier);
+        }
+    }
+    thread_unlock(lockEmulation);
+}
+
+/////////////
+// THREADS //
+/////////////
+
+void threadYielder(void* arg) {
+    for (long i = 0; i < iterations; i++) {
+        thread_yield();
+    }
+    finished();
+}
+
+// Holds the lock across a yield, so that every other contender blocks on it.
+void threadContender(void* arg) {
+    long rounds = (long)arg;
+    for (long i = 0; i < rounds; i++) {
+        thread_lock(lockBench);
+        thread_yield();
+        thread_unlock(lockBench);
+    }
+    finished();
+}
+
+// Takes turns with its partner: arg is the turn it waits for, 0 or 1.
+void threadPingPong(void* arg) {
+    int me = (int)(long)arg;
+    thread_lock(lockBench);
+    for (long i = 0; i < iterations; i++) {
+        while (turn != me) {
+            thread_wait(lockBench, me == 0 ? cvPing : cvPong);
+        }
+        turn = 1 - me;
+        thread_signal(lockBench, me == 0 ? cvPong : cvPing);
+    }
+    thread_unlock(lockBench);
+    finished();
+}
+
+// Waits for every new generation, then acknowledges it.
+void threadFanOutWaiter(void* arg) {
+    long rounds = (long)arg;
+    thread_lock(lockBench);
+    for (long seen = 0; seen < rounds; seen++) {
+        while (generation == seen) {
+            thread_wait(lockBench, cvFanOut);
+        }
+        acknowledged++;
+        thread_signal(lockBench, cvAck);
+    }
+    thread_unlock(lockBench);
+    finished();
+}
+
+// Hold the lock across a yield, so that the other readers and the writer find it taken.
+void threadReader(void* arg) {
+    long rounds = (long)arg;
+    for (long i = 0; i < rounds; i++) {
+        readLock();
+        thread_yield();
+        readUnlock();
+    }
+    finished();
+}
+
+void threadWriter(void* arg) {
+    long rounds = (long)arg;
+    for (long i = 0; i < rounds; i++) {
+        writeLock();
+        thread_yield();
+        writeUnlock();
+    }
+    finished();
+}
+
+// Passes a token back and forth with its partner: arg is 0 for the one that waits on semPing.
+void threadSemPingPong(void* arg) {
+    bool first = (long)arg == 0;
+    for (long i = 0; i < iterations; i++) {
+        if (first) {
+            semWait(semPing);
+            semPost(semPong);
+        } else {
+            semPost(semPing);
+            semWait(semPong);
+        }
+    }
+    finished();
+}
+
+void threadBarrier(void* arg) {
+    long rounds = (long)arg;
+    for (long i = 0; i < rounds; i++) {
+        barrierWait();
+    }
+    finished();
+}
+
+// Computes without ever calling the library, so only a quantum switches it out.
+volatile unsigned long spinSink;
+void threadSpinner(void* arg) {
+    long rounds = (long)arg;
+    unsigned long x = 1;
+    for (long i = 0; i < rounds; i++) {
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+    }
+    spinSink = x;
+    finished();
+}
+
+// Keeps the ready queue long until told to stop.
+void threadBackground(void* arg) {
+    while (stopYielding == false) {
+        thread_yield();
+    }
+    finished();
+}
+
+void threadEmpty(void* arg) {
+    finished();
+}
+
+void jobEmpty(void* arg) {
+}
+
+void* threadSquare(void* arg) {
+    long x = (long)arg;
+    return (void*)(x * x);
+}
+
+///////////
+// TASKS //
+///////////
+
+#ifdef __cpp_impl_coroutine
+thread_task taskYielder(long rounds) {
+    for (long i = 0; i < rounds; i++) {
+        co_await thread_co_yield();
+    }
+    co_await thread_co_lock(lockDone);
+    running--;
+    thread_signal(lockDone, cvDone);
+    thread_unlock(lockDone);
+}
+
+// The task side of a ping-pong with a thread, through the same lock and CVs.
+thread_task taskPingPong() {
+    co_await thread_co_lock(lockBench);
+    for (long i = 0; i < iterations; i++) {
+        while (turn != 1) {
+            co_await thread_co_wait(lockBench, cvPong);
+        }
+        turn = 0;
+        thread_signal(lockBench, cvPing);
+    }
+    thread_unlock(lockBench);
+    co_await thread_co_lock(lockDone);
+    running--;
+    thread_signal(lockDone, cvDone);
+    thread_unlock(lockDone);
+}
+#endif
+
+////////////////
+// BENCHMARKS //
+////////////////
+
+// Each returns the number of operations it did.
+
+static long benchYield() {
+    spawn(2, (thread_startfunc_t)threadYielder, NULL);
+    joinAll();
+    return 2 * iterations;
+}
+
+static long benchLockUncontended() {
+    for (long i = 0; i < iterations; i++) {
+        thread_lock(lockBench);
+        thread_unlock(lockBench);
+    }
+    return iterations;
+}
+
+static long benchSpecific() {
+    static unsigned int key;
+    static bool created = false;
+    if (created == false) {
+        thread_key_create(&key, NULL);
+        created = true;
+    }
+    for (long i = 0; i < iterations; i++) {
+        thread_setspecific(key, (char*)thread_getspecific(key) + 1);
+    }
+    return iterations;
+}
+
+static long benchLockContended() {
+    const int contenders = 4;
+    spawn(contenders, (thread_startfunc_t)threadContender, (void*)(iterations / contenders));
+    joinAll();
+    return iterations / contenders * contenders;
+}
+
+static long benchCondPingPong() {
+    turn = 0;
+    spawn(1, (thread_startfunc_t)threadPingPong, (void*)0);
+    spawn(1, (thread_startfunc_t)threadPingPong, (void*)1);
+    joinAll();
+    return iterations;
+}
+
+static long benchBroadcast() {
+    const int waiters = 16;
+    long rounds = iterations / waiters;
+    generation = 0;
+    spawn(waiters, (thread_startfunc_t)threadFanOutWaiter, (void*)rounds);
+    thread_lock(lockBench);
+    for (long i = 0; i < rounds; i++) {
+        acknowledged = 0;
+        generation++;
+        thread_broadcast(lockBench, cvFanOut);
+        while (acknowledged < waiters) {
+            thread_wait(lockBench, cvAck);
+        }
+    }
+    thread_unlock(lockBench);
+    joinAll();
+    return rounds * waiters;  // one operation per waiter woken
+}
+
+static long benchCreateExit() {
+    const int batch = 64;
+    long created = 0;
+    for (; created + batch <= iterations / 10; created += batch) {
+        spawn(batch, (thread_startfunc_t)threadEmpty, NULL);
+        joinAll();
+    }
+    return created;
+}
+
+// 4 readers to 1 writer.
+static long benchRWLock() {
+    const int readers = 4;
+    long rounds = iterations / (readers + 1);
+    spawn(readers, (thread_startfunc_t)threadReader, (void*)rounds);
+    spawn(1, (thread_startfunc_t)threadWriter, (void*)rounds);
+    joinAll();
+    return rounds * (readers + 1);
+}
+
+static long benchSemPingPong() {
+    thread_sem_init(semPing, 0);
+    thread_sem_init(semPong, 0);
+    emulatedSem[0] = emulatedSem[1] = 0;
+    spawn(1, (thread_startfunc_t)threadSemPingPong, (void*)0);
+    spawn(1, (thread_startfunc_t)threadSemPingPong, (void*)1);
+    joinAll();
+    return iterations;
+}
+
+static long benchBarrier() {
+    barrierThreads = 8;
+    long rounds = iterations / barrierThreads;
+    thread_barrier_init(barrierBench, barrierThreads);
+    emulatedArrived = 0;
+    spawn(barrierThreads, (thread_startfunc_t)threadBarrier, (void*)rounds);
+    joinAll();
+    return rounds * barrierThreads;
+}
+
+static long benchCreateN() {
+    const int batch = 64;
+    long created = 0;
+    for (; created + batch <= iterations / 10; created += batch) {
+        thread_lock(lockDone);
+        running += batch;
+        thread_unlock(lockDone);
+        thread_create_n((thread_startfunc_t)threadEmpty, NULL, batch);
+        joinAll();
+    }
+    return created;
+}
+
+// The create_exit batches as jobs of a pool of 8 workers.
+static long benchPoolSubmit() {
+    const int batch = 64;
+    long submitted = 0;
+    thread_pool_create(poolBench, 8);
+    for (; submitted + batch <= iterations / 10; submitted += batch) {
+        for (int i = 0; i < batch; i++) {
+            thread_pool_submit(poolBench, (thread_startfunc_t)jobEmpty, NULL);
+        }
+        thread_pool_wait(poolBench);
+    }
+    thread_pool_destroy(poolBench);
+    return submitted;
+}
+
+// As create_exit, but gathering a result from every thread through its future instead of a counter and CV.
+static long benchAsyncGather() {
+    const int batch = 64;
+    unsigned int futures[batch];
+    long created = 0;
+    long sum = 0;
+    for (; created + batch <= iterations / 10; created += batch) {
+        for (int i = 0; i < batch; i++) {
+            thread_async(threadSquare, (void*)(long)i, &futures[i]);
+        }
+        for (int i = 0; i < batch; i++) {
+            void* value;
+            thread_future_get(futures[i], &value);
+            sum += (long)value;
+        }
+    }
+    if (sum != created / batch * (batch - 1) * batch * (2 * batch - 1) / 6) {
+        printf("async_gather: wrong sum %ld\n", sum);
+    }
+    return created;
+}
+
+// cond_pingpong with 8 threads yielding in the background, which each handoff waits behind unless the woken
+// thread runs next.
+static long benchHandoff() {
+    const int background = 8;
+    unsigned int pair[2];
+    turn = 0;
+    stopYielding = false;
+    spawn(background, (thread_startfunc_t)threadBackground, NULL);
+    thread_lock(lockDone);
+    running += 2;
+    thread_unlock(lockDone);
+    thread_create_id((thread_startfunc_t)threadPingPong, (void*)0, &pair[0]);
+    thread_create_id((thread_startfunc_t)threadPingPong, (void*)1, &pair[1]);
+    thread_join(pair[0]);
+    thread_join(pair[1]);
+    stopYielding = true;
+    joinAll();
+    return iterations;
+}
+
+static long benchHandoffFifo() {
+    thread_set_wake_affinity(false);
+    return benchHandoff();
+}
+
+static long benchHandoffLifo() {
+    thread_set_wake_affinity(true);
+    long ops = benchHandoff();
+    thread_set_wake_affinity(false);
+    return ops;
+}
+
+static long benchSpin() {
+    long rounds = iterations * 1000;
+    spawn(2, (thread_startfunc_t)threadSpinner, (void*)rounds);
+    joinAll();
+    return 2 * rounds;
+}
+
+static long benchRWLockNative() {
+    native = true;
+    return benchRWLock();
+}
+
+static long benchRWLockEmulated() {
+    native = false;
+    return benchRWLock();
+}
+
+static long benchSemNative() {
+    native = true;
+    return benchSemPingPong();
+}
+
+static long benchSemEmulated() {
+    native = false;
+    return benchSemPingPong();
+}
+
+static long benchBarrierNative() {
+    native = true;
+    return benchBarrier();
+}
+
+static long benchBarrierEmulated() {
+    native = false;
+    return benchBarrier();
+}
+
+#ifdef __cpp_impl_coroutine
+// Many more tasks than could have a stack each.
+static long benchTaskYield() {
+    const int tasks = 10000;
+    long rounds = iterations / tasks + 1;
+    thread_lock(lockDone);
+    running += tasks;
+    thread_unlock(lockDone);
+    for (int i = 0; i < tasks; i++) {
+        thread_create_task(taskYielder(rounds));
+    }
+    joinAll();
+    return tasks * rounds;
+}
+
+static long benchTaskPingPong() {
+    turn = 0;
+    spawn(1, (thread_startfunc_t)threadPingPong, (void*)0);
+    thread_lock(lockDone);
+    running++;
+    thread_unlock(lockDone);
+    thread_create_task(taskPingPong());
+    joinAll();
+    return iterations;
+}
+#endif
+
+struct Benchmark {
+    const char* name;
+    long (*run)();
+};
+
+Benchmark benchmarks[] = {
+    {"yield", benchYield},
+    {"lock_uncontended", benchLockUncontended},
+    {"specific", benchSpecific},
+    {"lock_contended", benchLockContended},
+    {"cond_pingpong", benchCondPingPong},
+    {"broadcast_fanout", benchBroadcast},
+    {"handoff_fifo", benchHandoffFifo},
+    {"handoff_lifo", benchHandoffLifo},
+    {"create_exit", benchCreateExit},
+    {"async_gather", benchAsyncGather},
+    {"create_n", benchCreateN},
+    {"pool_submit", benchPoolSubmit},
+    {"spin", benchSpin},
+    {"rwlock_native", benchRWLockNative},
+    {"rwlock_emulated", benchRWLockEmulated},
+    {"sem_native", benchSemNative},
+    {"sem_emulated", benchSemEmulated},
+    {"barrier_native", benchBarrierNative},
+    {"barrier_emulated", benchBarrierEmulated},
+#ifdef __cpp_impl_coroutine
+    {"task_yield", benchTaskYield},
+    {"task_pingpong", benchTaskPingPong},
+#endif
+};
+
+// Initialized main thread. arg: name of the only benchmark to run, or NULL for all.
+void threadMain(void* arg) {
+    const char* only = (const char*)arg;
+    if (quantum > 0) {
+        thread_set_quantum(quantum);
+    }
+    for (Benchmark& benchmark : benchmarks) {
+        if (only != NULL && strcmp(only, benchmark.name) != 0) {
+            continue;
+        }
+        thread_stats_t before, after;
+        thread_getstats(&before);
+        double start = now();
+        long ops = benchmark.run();
+        double elapsed = now() - start;
+        thread_getstats(&after);
+        printf("%-20s %10ld ops %10.1f ns/op %8.3f switches/op %6lu preemptions\n", benchmark.name, ops,
+               elapsed / ops, (double)(after.switches - before.switches) / ops,
+               after.preemptions - before.preemptions);
+    }
+    fflush(stdout);
+}
+
+/**
+ * @brief Microbenchmarks of the thread library primitives.
+ *
+ * usage: bench [iterations [name|all [quantum_us]]]
+ * One line per benchmark: name, operations, ns/op, context switches per operation and quanta that preempted
+ * a thread. Without a quantum the switch counts only depend on the library, so they can be diffed between
+ * builds; the times depend on the machine. Build with -DTHREAD_FAST_MASK to time the cheaper masking.
+ *
+ * @return int
+ */
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        iterations = atol(argv[1]);
+        if (iterations < 640) {
+            iterations = 640;  // the creation benchmarks need iterations / 10 for one batch of 64 threads
+        }
+    }
+    const char* only = argc > 2 && strcmp(argv[2], "all") != 0 ? argv[2] : NULL;
+    if (argc > 3) {
+        quantum = atoi(argv[3]);
+    }
+    thread_libinit((thread_startfunc_t)threadMain, (void*)only);
+
+    return 0;
+}
\ No newline at end of file
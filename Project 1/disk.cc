@@ -1,8 +1,14 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <deque>
-#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <string>
 #include "thread.h"
@@ -12,6 +18,27 @@ struct Parameters {
     int maxRequests = 0;  // max number of requests qRequest can hold
     int numThreads = 0;   // number of living requester
     std::string threadName[100];
+    bool asyncMode = false;  // requesters keep up to maxInFlight[] requests outstanding instead of one
+    int maxInFlight[100];    // K of each requester, only used in async mode
+    bool batchMode = false;  // server drains qRequest in one elevator sweep and wakes requesters one by one
+    bool reportStats = false;
+    int totalThreads = 0;  // number of requesters ever created
+    bool geometryModel = false;  // charge every service with seek, rotation and transfer time of DiskGeometry
+    bool sptf = false;           // shortest-positioning-time-first instead of shortest-seek-first
+    bool ringMode = false;       // requesters submit through SubmissionRing instead of locking mutexQRequest
+};
+
+// Physical layout and timing of the simulated disk. Times are in milliseconds.
+struct DiskGeometry {
+    int cylinders = 1000;
+    int heads = 1;                  // tracks per cylinder: track t lies on cylinder t / heads, surface t % heads
+    int sectorsPerTrack = 64;
+    double rpm = 7200;
+    double settleTime = 1.0;        // paid by every seek of at least one cylinder
+    double seekSqrt = 0.3;          // short seeks: settleTime + seekSqrt * sqrt(distance)
+    double seekLinear = 0.002;      // long seeks: continue linearly with seekLinear per cylinder
+    int seekBoundary = 400;         // distance in cylinders where the sqrt region ends
+    double headSwitchTime = 0.5;    // changing surface without changing cylinder
 };
 
 // A disk request, include:
@@ -20,23 +47,216 @@ struct Parameters {
 struct Request {
     int requesterID;
     int track;
+    int sector;         // -1 if the input file gives no sector
+    double submitTime;  // simulated time when the request entered qRequest
+};
+
+// All requests of one requester, parsed from its file before the thread library starts.
+// Requests are never allocated or freed one by one: they live here until the program exits.
+struct RequestArena {
+    Request* requests;  // contiguous, in file order
+    int size;
 };
 
 // globals
 Parameters param;                                // SHALL NOT BE MODIFIED ANYWHERE - NO MUTEX VARIABLE FOR THIS TO AVOID POTENTIAL PROBLEMS
 std::deque<Request*> qRequest;                   // request queue. To sort() on a queue, it must be a deque to use .begin() and .end() methods.
 int nowtrack = 0;                                // current location of the disk tracker
+int direction = 1;                               // direction of the last elevator sweep: 1 upward, -1 downward
+DiskGeometry geometry;                           // only used when param.geometryModel is on
+double nowTime = 0;                              // simulated time of the disk, in milliseconds
+double sumResponseTime = 0, maxResponseTime = 0;
+int numServed = 0;
+RequestArena* arenas;                            // arenas[requesterID]
 unsigned int mutexQRequest;                      // mutex variable for access to qRequest
 unsigned int cvQRequestFull, cvQRequestNotFull;  // condition variables for qRequest
 bool* hasJobInQueue;                             // if hasJobInQueue[requesterID] no more requests, because:
                                                  // "Each request is synchronous; a requester thread must wait until the servicing thread finishes handling its last request before issuing its next request."
 
+// globals for async mode only
+int* numInFlight;                   // numInFlight[requesterID]: requests sent whose completion is not reaped yet
+bool* doneReading;                  // doneReading[requesterID]: requester has reached the end of its file
+std::deque<Request*>* qCompletion;  // qCompletion[requesterID]: served requests, to be reaped by the requester
+int liveCapacity = 0;               // most requests the living requesters can still put into qRequest
+bool* isSleeping;                   // isSleeping[requesterID]: requester waits on its own CV (batch mode only)
+unsigned int cvRequesterBase;       // cvRequesterBase + requesterID: private CV of each requester, for completions
+                                    // in async mode and for every wait in batch mode
+
+// Bounded lock-free multi-producer/single-consumer ring. Requesters push, only the server pops.
+// Every slot carries a sequence number telling whether it is free for position pos (sequence == pos)
+// or holds the request of position pos (sequence == pos + 1).
+struct SubmissionRing {
+    struct Slot {
+        std::atomic<size_t> sequence;
+        Request* req;
+    };
+    Slot* slots;
+    size_t mask;                // number of slots - 1, a power of two
+    std::atomic<size_t> tail;   // next position to claim, shared by requesters
+    size_t head;                // next position to take, owned by the server
+};
+
+// globals for ring mode only. qRequest is then the private scheduling index of the server
+SubmissionRing ring;
+std::atomic<int> credits;            // free places in qRequest + ring: param.maxRequests without a lock
+std::atomic<int> ringCapacity;       // liveCapacity, shared by requesters and server without a lock
+std::atomic<int>* freeSlots;         // freeSlots[requesterID]: maxInFlight - requests in flight, | RING_CLOSED at EOF
+#define RING_CLOSED 0x40000000
+unsigned int mutexRing;              // only taken to sleep on or signal a CV, never to submit
+std::atomic<int> serverWaiting;      // server sleeps on cvQRequestFull
+std::atomic<int> creditWaiters;      // requesters sleeping on cvQRequestNotFull for a credit
+std::atomic<int>* slotWaiting;       // slotWaiting[requesterID]: requester sleeps on cvRequesterBase + requesterID
+
 // #define ABS(x) ((x)>0 ? (x) : -(x))      // would rather use std::abs() in <algorithm>
 
 bool requestSorter(Request* a, Request* b) {
     return std::abs(a->track - nowtrack) < std::abs(b->track - nowtrack);
 }
 
+// Time to move the head from nowtrack to track, including settling or switching heads.
+double seekTime(int track) {
+    // the arm cannot travel further than from the first cylinder to the last
+    int distance = std::min(std::abs(track / geometry.heads - nowtrack / geometry.heads), geometry.cylinders - 1);
+    if (distance == 0) {
+        return track == nowtrack ? 0 : geometry.headSwitchTime;
+    }
+    if (distance < geometry.seekBoundary) {
+        return geometry.settleTime + geometry.seekSqrt * std::sqrt((double)distance);
+    }
+    return geometry.settleTime + geometry.seekSqrt * std::sqrt((double)geometry.seekBoundary) +
+           geometry.seekLinear * (distance - geometry.seekBoundary);
+}
+
+// Time from nowTime until req's sector is under the head, ready for transfer.
+double positioningTime(Request* req) {
+    double rotation = 60000.0 / geometry.rpm;
+    double seek = seekTime(req->track);
+    if (req->sector < 0) {
+        return seek + rotation / 2;  // unknown sector: expected rotational delay
+    }
+    // the platter keeps spinning during the seek
+    double underHead = std::fmod((nowTime + seek) / rotation, 1.0) * geometry.sectorsPerTrack;
+    double sectors = std::fmod(req->sector - underHead + geometry.sectorsPerTrack, (double)geometry.sectorsPerTrack);
+    return seek + sectors / geometry.sectorsPerTrack * rotation;
+}
+
+// Move the request with the shortest positioning time to the front of qRequest.
+// MUST run this function with mutex promise to qRequest
+void selectShortestPositioning() {
+    size_t best = 0;
+    double bestTime = positioningTime(qRequest[0]);
+    for (size_t i = 1; i < qRequest.size(); i++) {
+        double time = positioningTime(qRequest[i]);
+        if (time < bestTime) {
+            best = i;
+            bestTime = time;
+        }
+    }
+    std::swap(qRequest[0], qRequest[best]);
+}
+
+void ringInit(int capacity) {
+    size_t size = 1;
+    while (size < (size_t)capacity) {
+        size <<= 1;
+    }
+    ring.slots = new SubmissionRing::Slot[size];
+    for (size_t i = 0; i < size; i++) {
+        ring.slots[i].sequence.store(i, std::memory_order_relaxed);
+        ring.slots[i].req = NULL;
+    }
+    ring.mask = size - 1;
+    ring.tail.store(0, std::memory_order_relaxed);
+    ring.head = 0;
+}
+
+// Called by any requester. Return false if the ring is full.
+bool ringPush(Request* req) {
+    size_t pos = ring.tail.load(std::memory_order_relaxed);
+    while (true) {
+        SubmissionRing::Slot* slot = &ring.slots[pos & ring.mask];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        long diff = (long)sequence - (long)pos;
+        if (diff == 0) {
+            // slot is free for pos: claim pos, then publish the request
+            if (ring.tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot->req = req;
+                slot->sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;  // the server has not taken this slot one lap ago yet
+        } else {
+            pos = ring.tail.load(std::memory_order_relaxed);  // another requester claimed pos
+        }
+    }
+}
+
+// Called by the server only. Return NULL if the ring is empty.
+Request* ringPop() {
+    SubmissionRing::Slot* slot = &ring.slots[ring.head & ring.mask];
+    if (slot->sequence.load(std::memory_order_acquire) != ring.head + 1) {
+        return NULL;
+    }
+    Request* req = slot->req;
+    slot->sequence.store(ring.head + ring.mask + 1, std::memory_order_release);  // free for the next lap
+    ring.head++;
+    return req;
+}
+
+// Return true if the server has a request to pop.
+bool ringReady() {
+    return ring.slots[ring.head & ring.mask].sequence.load(std::memory_order_acquire) == ring.head + 1;
+}
+
+// Sleep on cv until ready(arg) is true. waiting counts the sleepers, so that whoever makes ready() true
+// only takes mutexRing to signal cv when somebody sleeps on it.
+void ringSleep(std::atomic<int>& waiting, unsigned int cv, bool (*ready)(long), long arg) {
+    thread_lock(mutexRing);
+    waiting.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);  // pairs with the fence in ringWake()
+    while (ready(arg) == false) {
+        thread_wait(mutexRing, cv);
+    }
+    waiting.fetch_sub(1);
+    thread_unlock(mutexRing);
+}
+
+// Wake one thread sleeping in ringSleep() on cv, after changing what it waits for. A sleeper holds mutexRing
+// from counting itself in waiting until thread_wait(), so the signal cannot fall between its check and its wait.
+void ringWake(std::atomic<int>& waiting, unsigned int cv) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load(std::memory_order_relaxed) > 0) {
+        thread_lock(mutexRing);
+        thread_signal(mutexRing, cv);
+        thread_unlock(mutexRing);
+    }
+}
+
+// Take one of the param.maxRequests places in the queue. Return false if there is none left.
+bool takeCredit() {
+    int available = credits.load(std::memory_order_relaxed);
+    while (available > 0) {
+        if (credits.compare_exchange_weak(available, available - 1, std::memory_order_acquire)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Elevator order: continue the current sweep from nowtrack, then come back for the rest.
+bool elevatorSorter(Request* a, Request* b) {
+    bool aAhead = (a->track - nowtrack) * direction >= 0;
+    bool bAhead = (b->track - nowtrack) * direction >= 0;
+    if (aAhead != bAhead) {
+        return aAhead;
+    }
+    if (aAhead) {
+        return (a->track - b->track) * direction < 0;  // nearest first along the sweep
+    }
+    return (a->track - b->track) * direction > 0;  // on the way back, nearest first as well
+}
+
 // MUST run this function with mutex promise to qRequest
 void sendRequest(Request* req) {
     using namespace std;
@@ -44,50 +264,219 @@ void sendRequest(Request* req) {
     int requester = req->requesterID;
     int track = req->track;
     cout << "requester " << requester << " track " << track << endl;
+    req->submitTime = nowTime;
     qRequest.push_back(req);
-    // sort qRequest by absolute distance to nowtrack
-    std::sort(qRequest.begin(), qRequest.end(), requestSorter);
-    // indicate has a job in queue, no more requests can be sent
-    hasJobInQueue[requester] = true;
+    if (param.batchMode == false && param.sptf == false) {
+        // sort qRequest by absolute distance to nowtrack. batch mode sorts once per sweep instead
+        std::sort(qRequest.begin(), qRequest.end(), requestSorter);
+    }
+    if (param.asyncMode) {
+        // one more request in flight, the requester decides by itself whether it can send more
+        numInFlight[requester]++;
+    } else {
+        // indicate has a job in queue, no more requests can be sent
+        hasJobInQueue[requester] = true;
+    }
 }
 
 // MUST run this function with mutex promise to qRequest
 void serveRequest() {
     using namespace std;
     // fetch a request
+    if (param.sptf) {
+        selectShortestPositioning();
+    }
     Request* req = qRequest.front();
     // serve the request
     int requester = req->requesterID;
     int track = req->track;
-    cout << "service requester " << requester << " track " << track << endl;
-    // mark as job removed, allow more requests from this file
-    hasJobInQueue[requester] = false;
+    if (param.geometryModel) {
+        nowTime += positioningTime(req) + 60000.0 / geometry.rpm / geometry.sectorsPerTrack;
+        double responseTime = nowTime - req->submitTime;
+        sumResponseTime += responseTime;
+        maxResponseTime = std::max(maxResponseTime, responseTime);
+        numServed++;
+        cout << "service requester " << requester << " track " << track << " done " << std::fixed << std::setprecision(3) << nowTime << endl;
+    } else {
+        cout << "service requester " << requester << " track " << track << endl;
+    }
     // remove the request from the request queue
     qRequest.pop_front();
-    delete req;
+    if (param.ringMode) {
+        // give the place in the queue back, then the slot of the requester
+        credits.fetch_add(1, std::memory_order_release);
+        ringWake(creditWaiters, cvQRequestNotFull);
+        if (freeSlots[requester].fetch_add(1, std::memory_order_acq_rel) & RING_CLOSED) {
+            ringCapacity.fetch_sub(1, std::memory_order_release);  // this requester will never send a request again
+        } else {
+            ringWake(slotWaiting[requester], cvRequesterBase + requester);
+        }
+    } else if (param.asyncMode) {
+        // hand the request back through the completion queue of its requester, which counts it out of numInFlight
+        if (doneReading[requester] == true) {
+            liveCapacity--;  // this requester will never send a request again
+        }
+        qCompletion[requester].push_back(req);
+        if (param.batchMode == false) {
+            thread_signal(mutexQRequest, cvRequesterBase + requester);
+        }
+    } else {
+        // mark as job removed, allow more requests from this file
+        hasJobInQueue[requester] = false;
+    }
+    if (track != nowtrack) {
+        direction = track > nowtrack ? 1 : -1;
+    }
     nowtrack = track;
 }
 
+// Serve every request in qRequest in one elevator sweep, then wake each sleeping requester exactly once.
+// MUST run this function with mutex promise to qRequest
+void serveBatch() {
+    if (param.sptf == false) {
+        std::sort(qRequest.begin(), qRequest.end(), elevatorSorter);
+    }  // otherwise serveRequest() picks greedily by positioning time
+    while (qRequest.empty() == false) {
+        serveRequest();
+    }
+    for (int i = 0; i < param.totalThreads; i++) {
+        if (isSleeping[i] == true) {
+            isSleeping[i] = false;
+            thread_signal(mutexQRequest, cvRequesterBase + i);  // targeted: nobody else waits on this CV
+        }
+    }
+}
+
+// Block requester until the server changes qRequest. cvShared is the CV to wait on when not in batch mode.
+// MUST run this function with mutex promise to qRequest
+void requesterWait(int requester, unsigned int cvShared) {
+    if (param.batchMode) {
+        isSleeping[requester] = true;
+        thread_wait(mutexQRequest, cvRequesterBase + requester);
+    } else {
+        thread_wait(mutexQRequest, cvShared);
+    }
+}
+
+// Number of requests the server waits for before serving one.
+// MUST run this function with mutex promise to qRequest
+int queueDepth() {
+    if (param.asyncMode) {
+        // "the largest number of requests in the queue" is bounded by what the living requesters can still send
+        return std::min(param.maxRequests, liveCapacity);
+    }
+    return param.maxRequests;
+}
+
+// Take every served request of requester out of its completion queue, freeing one in-flight place for each.
+// Return how many were taken. A completion that is not one of the requester's own requests is fatal.
+// MUST run this function with mutex promise to qRequest
+int reapCompletions(int requester) {
+    RequestArena& arena = arenas[requester];
+    int reaped = 0;
+    while (qCompletion[requester].empty() == false) {
+        Request* req = qCompletion[requester].front();
+        qCompletion[requester].pop_front();
+        if (req->requesterID != requester || req < arena.requests || req >= arena.requests + arena.size) {
+            std::cerr << "- requester " << requester << " got a completion of requester " << req->requesterID << std::endl;
+            exit(1);
+        }
+        std::cerr << "- request " << requester << " completed track " << req->track << " sector " << req->sector << std::endl;
+        reaped++;
+    }
+    numInFlight[requester] -= reaped;
+    return reaped;
+}
+
+// Parse a decimal integer at p, moving p past it. Return false if p does not point at one.
+bool parseInt(const char*& p, const char* end, int& value) {
+    bool negative = false;
+    if (p < end && *p == '-') {
+        negative = true;
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        return false;
+    }
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p - '0');
+        p++;
+    }
+    if (negative) {
+        value = -value;
+    }
+    return true;
+}
+
+// Parse every "track [sector]" line of filename into a new arena for requesterID. Lines that do not start
+// with a number are skipped. A file that cannot be read gives an empty arena, as an empty file does.
+RequestArena loadRequests(const std::string& filename, int requesterID) {
+    RequestArena arena;
+    arena.requests = NULL;
+    arena.size = 0;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return arena;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return arena;
+    }
+    void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return arena;
+    }
+    const char* p = (const char*)mapped;
+    const char* end = p + info.st_size;
+
+    // one request per line at most
+    size_t lines = 1;
+    for (const char* q = p; (q = (const char*)memchr(q, '\n', end - q)) != NULL; q++) {
+        lines++;
+    }
+    arena.requests = new Request[lines];
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+            p++;
+        }
+        int track, sector = -1;
+        if (parseInt(p, end, track)) {
+            while (p < end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            if (parseInt(p, end, sector) == false) {
+                sector = -1;
+            }
+            Request* req = &arena.requests[arena.size++];
+            req->requesterID = requesterID;
+            req->track = track;
+            req->sector = sector;
+            req->submitTime = 0;
+        }
+        // skip the rest of the line
+        const char* newline = (const char*)memchr(p, '\n', end - p);
+        p = newline == NULL ? end : newline + 1;
+    }
+    munmap(mapped, info.st_size);
+
+    return arena;
+}
+
 void threadRequester(void* argRequesterID) {
     // parse arg
     long requesterID = (long)argRequesterID;
     std::string filename = param.threadName[requesterID];
     std::cerr << "- thread of requesterID: " << requesterID << "  filename: " << filename << std::endl;
 
-    // read file
-    std::ifstream file;
-    file.open(filename, std::ios::in);
-    while (!file.eof()) {
-        int requestTrack;
-        file >> requestTrack;
-        if (file.eof()) {
-            break;
-        }
-
-        // pack up a new request
-        Request* req = new Request;
-        req->requesterID = requesterID;
-        req->track = requestTrack;
+    // requests were parsed by loadRequests() before the thread library started
+    RequestArena& arena = arenas[requesterID];
+    for (int i = 0; i < arena.size; i++) {
+        Request* req = &arena.requests[i];
 
         thread_lock(mutexQRequest);
         std::cerr << "- request " << requesterID << " lock mutex" << std::endl;
@@ -95,18 +484,17 @@ void threadRequester(void* argRequesterID) {
         while (qRequest.size() >= param.maxRequests || hasJobInQueue[requesterID] == true) {
             // queue full; or current file has a pending request
             std::cerr << "- request " << requesterID << " wait and unlock mutex" << std::endl;
-            thread_wait(mutexQRequest, cvQRequestNotFull);
+            requesterWait(requesterID, cvQRequestNotFull);
             std::cerr << "- request " << requesterID << " awake and lock mutex" << std::endl;
         }
         sendRequest(req);
         std::cerr << "- request " << requesterID << " signal" << std::endl;
         thread_broadcast(mutexQRequest, cvQRequestFull);  // inform server (may not be served though, because queue might not be full)
     }
-    file.close();
 
     // this requester died, decline param.numThreads for qRequest
     while (hasJobInQueue[requesterID] == true) {
-        thread_wait(mutexQRequest, cvQRequestNotFull);
+        requesterWait(requesterID, cvQRequestNotFull);
     }
     param.numThreads--;  // THIS IS NOT SAFE
     if (param.numThreads < param.maxRequests) {
@@ -123,17 +511,164 @@ void threadRequester(void* argRequesterID) {
     std::cerr << "- exiting request " << requesterID << std::endl;
 }
 
+// Requester in async mode: keeps up to param.maxInFlight[requesterID] requests in qRequest, and learns about
+// served ones from its completion queue instead of waiting for each of them. A request stays in flight until
+// the requester has reaped its completion, so completions pace the next submissions.
+void threadRequesterAsync(void* argRequesterID) {
+    // parse arg
+    long requesterID = (long)argRequesterID;
+    std::string filename = param.threadName[requesterID];
+    std::cerr << "- async thread of requesterID: " << requesterID << "  filename: " << filename << std::endl;
+
+    // requests were parsed by loadRequests() before the thread library started
+    RequestArena& arena = arenas[requesterID];
+    int completed = 0;
+    for (int i = 0; i < arena.size; i++) {
+        Request* req = &arena.requests[i];
+
+        thread_lock(mutexQRequest);
+        completed += reapCompletions(requesterID);
+        while (numInFlight[requesterID] >= param.maxInFlight[requesterID] || qRequest.size() >= param.maxRequests) {
+            if (numInFlight[requesterID] >= param.maxInFlight[requesterID]) {
+                // K requests in flight: wait until the server completes one of ours
+                std::cerr << "- request " << requesterID << " wait for completion" << std::endl;
+                requesterWait(requesterID, cvRequesterBase + requesterID);
+            } else {
+                // queue full
+                std::cerr << "- request " << requesterID << " wait and unlock mutex" << std::endl;
+                requesterWait(requesterID, cvQRequestNotFull);
+            }
+            completed += reapCompletions(requesterID);
+        }
+        sendRequest(req);
+        thread_broadcast(mutexQRequest, cvQRequestFull);  // inform server
+        thread_unlock(mutexQRequest);
+    }
+
+    // this requester will send nothing more: give up the slots it is not using.
+    // after reaping, numInFlight counts exactly the requests still in qRequest
+    thread_lock(mutexQRequest);
+    completed += reapCompletions(requesterID);
+    doneReading[requesterID] = true;
+    liveCapacity -= param.maxInFlight[requesterID] - numInFlight[requesterID];
+    thread_broadcast(mutexQRequest, cvQRequestFull);  // inform server that maybe another request can be served
+    while (numInFlight[requesterID] > 0) {
+        requesterWait(requesterID, cvRequesterBase + requesterID);
+        completed += reapCompletions(requesterID);
+    }
+    thread_unlock(mutexQRequest);
+
+    // exit this thread
+    std::cerr << "- exiting async request " << requesterID << " after " << completed << " completions" << std::endl;
+}
+
+// ringSleep() conditions of ring mode
+bool hasFreeSlot(long requesterID) {
+    return freeSlots[requesterID].load(std::memory_order_acquire) > 0;
+}
+
+bool gotCredit(long) {
+    return takeCredit();
+}
+
+bool serverHasWork(long) {
+    int depth = std::min(param.maxRequests, ringCapacity.load(std::memory_order_acquire));
+    return ringReady() || (int)qRequest.size() >= depth;
+}
+
+// Requester in ring mode: never takes mutexQRequest. It waits for a free slot of its own and a credit
+// for qRequest, then pushes into the ring. It only takes mutexRing to sleep when it has to wait.
+void threadRequesterRing(void* argRequesterID) {
+    // parse arg
+    long requesterID = (long)argRequesterID;
+    std::string filename = param.threadName[requesterID];
+    std::cerr << "- ring thread of requesterID: " << requesterID << "  filename: " << filename << std::endl;
+
+    // requests were parsed by loadRequests() before the thread library started
+    RequestArena& arena = arenas[requesterID];
+    for (int i = 0; i < arena.size; i++) {
+        Request* req = &arena.requests[i];
+
+        // only this requester takes its own slots, so checking then decrementing is safe
+        if (hasFreeSlot(requesterID) == false) {
+            ringSleep(slotWaiting[requesterID], cvRequesterBase + requesterID, hasFreeSlot, requesterID);
+        }
+        freeSlots[requesterID].fetch_sub(1, std::memory_order_relaxed);
+        if (takeCredit() == false) {
+            ringSleep(creditWaiters, cvQRequestNotFull, gotCredit, 0);
+        }
+        // a credit stands for a place in qRequest + ring, and the ring has at least param.maxRequests slots
+        if (ringPush(req) == false) {
+            std::cerr << "- ring full with a credit held" << std::endl;
+            exit(1);
+        }
+        std::cout << "requester " << requesterID << " track " << req->track << std::endl;
+        ringWake(serverWaiting, cvQRequestFull);
+    }
+
+    // this requester will send nothing more: give up the slots it is not using.
+    // slots freed after this are given up by the server, which sees RING_CLOSED
+    int unused = freeSlots[requesterID].fetch_or(RING_CLOSED, std::memory_order_acq_rel);
+    ringCapacity.fetch_sub(unused, std::memory_order_release);
+    ringWake(serverWaiting, cvQRequestFull);  // the queue the server waits to fill may have shrunk
+
+    // exit this thread
+    std::cerr << "- exiting ring request " << requesterID << std::endl;
+}
+
+// Server in ring mode: pulls submissions from the ring into its private qRequest and serves from there.
+void threadServerRing(void* arg) {
+    while (true) {
+        Request* req;
+        bool pulled = false;
+        while ((req = ringPop()) != NULL) {
+            req->submitTime = nowTime;
+            qRequest.push_back(req);
+            pulled = true;
+        }
+        if (pulled && param.sptf == false) {
+            std::sort(qRequest.begin(), qRequest.end(), requestSorter);
+        }
+        int depth = std::min(param.maxRequests, ringCapacity.load(std::memory_order_acquire));
+        if (depth <= 0 && qRequest.empty()) {
+            break;
+        }
+        if ((int)qRequest.size() < depth) {
+            // qRequest is not full yet: sleep until a requester submits or gives up its slots
+            ringSleep(serverWaiting, cvQRequestFull, serverHasWork, 0);
+            continue;
+        }
+        serveRequest();
+    }
+    if (param.geometryModel) {
+        std::cout << "simulated time " << std::fixed << std::setprecision(3) << nowTime << " ms mean response "
+                  << (numServed ? sumResponseTime / numServed : 0) << " ms max response " << maxResponseTime << " ms" << std::endl;
+    }
+    if (param.reportStats) {
+        thread_stats_t stats;
+        thread_getstats(&stats);
+        std::cout << "stats switches " << stats.switches << " locks " << stats.locks << " wakeups " << stats.wakeups << std::endl;
+    }
+
+    // exit this thread
+}
+
 // accept no arg
 void threadServer(void* arg) {
     std::cerr << "- server lock mutex" << std::endl;
     thread_lock(mutexQRequest);  // lock it anyway, because thread_wait() is going to unlock it
-    while (param.maxRequests > 0) {
-        while (qRequest.size() < param.maxRequests) {
+    while (queueDepth() > 0) {
+        while (qRequest.size() < queueDepth()) {
             // qRequest is not full yet (if no more new request, param.maxRequests decline itself so no need to worry)
             std::cerr << "- server wait and unlock mutex" << std::endl;
             thread_wait(mutexQRequest, cvQRequestFull);
             std::cerr << "- server awake and lock mutex" << std::endl;
         }
+        if (param.batchMode) {
+            // wake-ups are targeted and done by serveBatch() itself
+            serveBatch();
+            continue;
+        }
         if (qRequest.empty() == false) {
             // do this judgement because no service for situation if param.maxRequests is 0. this happened at last
             serveRequest();
@@ -141,6 +676,15 @@ void threadServer(void* arg) {
         std::cerr << "- server signal" << std::endl;
         thread_broadcast(mutexQRequest, cvQRequestNotFull);  // broadcast instead of signal because all threads shall wake up now
     }
+    if (param.geometryModel) {
+        std::cout << "simulated time " << std::fixed << std::setprecision(3) << nowTime << " ms mean response "
+                  << (numServed ? sumResponseTime / numServed : 0) << " ms max response " << maxResponseTime << " ms" << std::endl;
+    }
+    if (param.reportStats) {
+        thread_stats_t stats;
+        thread_getstats(&stats);
+        std::cout << "stats switches " << stats.switches << " locks " << stats.locks << " wakeups " << stats.wakeups << std::endl;
+    }
     std::cerr << "- server unlock mutex" << std::endl;
     thread_unlock(mutexQRequest);
 
@@ -153,48 +697,200 @@ void threadMain(void* arg) {
     std::cerr << "- Max Requests: " << param.maxRequests << std::endl;
 
     // create requesters
-    for (long i = 0; i < param.numThreads; i++) {  // using long because long -> void* shall match
-        if (thread_create((thread_startfunc_t)threadRequester, (void*)i)) {
-            std::cerr << "- thread_create FAILED for request " << i << std::endl;
-            exit(1);
-        }
+    thread_startfunc_t requester = (thread_startfunc_t)(param.asyncMode ? threadRequesterAsync : threadRequester);
+    thread_startfunc_t server = (thread_startfunc_t)threadServer;
+    if (param.ringMode) {
+        requester = (thread_startfunc_t)threadRequesterRing;
+        server = (thread_startfunc_t)threadServerRing;
+    }
+    if (thread_create_n(requester, NULL, param.numThreads)) {  // requester i gets (void*)i
+        std::cerr << "- thread_create_n FAILED for requesters" << std::endl;
+        exit(1);
     }
 
     // create a server
-    if (thread_create((thread_startfunc_t)threadServer, NULL)) {
+    if (thread_create(server, NULL)) {
         std::cerr << "- thread_create FAILED for server." << std::endl;
         exit(1);
     }
 }
 
+// Parse "key=value,key=value" into geometry. Return false if anything is unknown or out of range.
+bool parseGeometry(const std::string& spec) {
+    size_t begin = 0;
+    while (begin < spec.size()) {
+        size_t end = spec.find(',', begin);
+        if (end == std::string::npos) {
+            end = spec.size();
+        }
+        std::string item = spec.substr(begin, end - begin);
+        size_t equal = item.find('=');
+        if (equal == std::string::npos) {
+            return false;
+        }
+        std::string key = item.substr(0, equal);
+        const char* text = item.c_str() + equal + 1;
+        char* rest;
+        double value = std::strtod(text, &rest);
+        if (rest == text || *rest != '\0' || std::isfinite(value) == false || value < 0) {
+            return false;  // empty, not a number, trailing garbage, inf/nan or negative
+        }
+        bool integral = value == std::floor(value) && value <= 1e9;
+        if ((key == "cylinders" || key == "heads" || key == "sectors" || key == "boundary") && integral == false) {
+            return false;
+        }
+        if (key == "cylinders") {
+            geometry.cylinders = (int)value;
+        } else if (key == "heads") {
+            geometry.heads = (int)value;
+        } else if (key == "sectors") {
+            geometry.sectorsPerTrack = (int)value;
+        } else if (key == "rpm") {
+            geometry.rpm = value;
+        } else if (key == "settle") {
+            geometry.settleTime = value;
+        } else if (key == "sqrt") {
+            geometry.seekSqrt = value;
+        } else if (key == "linear") {
+            geometry.seekLinear = value;
+        } else if (key == "boundary") {
+            geometry.seekBoundary = (int)value;
+        } else if (key == "headswitch") {
+            geometry.headSwitchTime = value;
+        } else {
+            return false;
+        }
+        begin = end + 1;
+    }
+    return geometry.cylinders > 0 && geometry.heads > 0 && geometry.sectorsPerTrack > 0 && geometry.rpm > 0;
+}
+
+// Return false if a request of arena lies outside the disk: past the last cylinder, or past the last sector of a track.
+bool checkGeometry(const RequestArena& arena) {
+    for (int i = 0; i < arena.size; i++) {
+        const Request& req = arena.requests[i];
+        if (req.track < 0 || req.track / geometry.heads >= geometry.cylinders || req.sector >= geometry.sectorsPerTrack) {
+            std::cerr << "- request " << req.requesterID << " track " << req.track << " sector " << req.sector
+                      << " is not on the disk" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(int argc, char** argv) {
     // for DEBUG. comment this to see all debug output
     freopen("/dev/null", "w", stderr);
 
-    // arguments parser
-    if (argc < 2) {  // illegal argument number
+    // options parser
+    //   -a K: async mode, every requester keeps up to K requests in flight.
+    //         In async mode an input filename may end with ":K" to give that requester its own K.
+    //   -b:   batch mode, the server serves the whole queue in one elevator sweep per lock hold.
+    //   -s:   print the thread library counters (context switches, lock acquisitions, wake-ups) at the end.
+    //   -g key=value,...: simulate DiskGeometry and report completion times. keys are cylinders, heads,
+    //         sectors, rpm, settle, sqrt, linear, boundary and headswitch, e.g. -g rpm=5400,heads=4
+    //   -p sstf|sptf: scheduling policy. sptf needs the geometry model, and turns it on with defaults.
+    //   -r:   ring mode, requesters submit through a lock-free ring and max_disk_queue is kept by credits.
+    //         Cannot be combined with -b.
+    int argi = 1;
+    int defaultInFlight = 1;
+    while (argi < argc && argv[argi][0] == '-') {
+        std::string option = argv[argi];
+        if (option == "-a" && argi + 1 < argc) {
+            param.asyncMode = true;
+            defaultInFlight = std::atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (option == "-b") {
+            param.batchMode = true;
+            argi++;
+        } else if (option == "-s") {
+            param.reportStats = true;
+            argi++;
+        } else if (option == "-r") {
+            param.ringMode = true;
+            argi++;
+        } else if (option == "-g" && argi + 1 < argc && parseGeometry(argv[argi + 1])) {
+            param.geometryModel = true;
+            argi += 2;
+        } else if (option == "-p" && argi + 1 < argc && (std::string(argv[argi + 1]) == "sstf" || std::string(argv[argi + 1]) == "sptf")) {
+            param.sptf = std::string(argv[argi + 1]) == "sptf";
+            param.geometryModel = param.geometryModel || param.sptf;
+            argi += 2;
+        } else {
+            std::cerr << "- Invalid Arguments." << std::endl;
+            return 0;
+        }
+    }
+    if (defaultInFlight < 1 || (param.ringMode && param.batchMode)) {
         std::cerr << "- Invalid Arguments." << std::endl;
         return 0;
     }
-    param.maxRequests = std::atoi(argv[1]);
-    // if arg 1 is invalid
-    if (param.maxRequests < 1 || param.maxRequests > argc - 2) {
+
+    // arguments parser
+    if (argc - argi < 1) {  // illegal argument number
         std::cerr << "- Invalid Arguments." << std::endl;
         return 0;
     }
+    param.maxRequests = std::atoi(argv[argi]);
     // args of input filenames
-    for (int i = 2; i < argc; i++) {
-        param.threadName[i - 2] = argv[i];
+    for (int i = argi + 1; i < argc; i++) {
+        std::string name = argv[i];
+        int inFlight = defaultInFlight;
+        size_t colon = name.find_last_of(':');
+        if (param.asyncMode && colon != std::string::npos && colon + 1 < name.size() &&
+            name.find_first_not_of("0123456789", colon + 1) == std::string::npos) {
+            inFlight = std::atoi(name.c_str() + colon + 1);
+            name = name.substr(0, colon);
+        }
+        if (inFlight < 1) {
+            std::cerr << "- Invalid Arguments." << std::endl;
+            return 0;
+        }
+        param.threadName[i - argi - 1] = name;
+        param.maxInFlight[i - argi - 1] = inFlight;
+        liveCapacity += inFlight;
+    }
+    // if max_disk_queue is invalid: at most one request per requester in sync mode, K per requester in async mode
+    if (param.maxRequests < 1 || param.maxRequests > liveCapacity) {
+        std::cerr << "- Invalid Arguments." << std::endl;
+        return 0;
     }
 
     // initialize globals
     nowtrack = 0;
-    param.numThreads = argc - 2;
+    param.numThreads = argc - argi - 1;
+    param.totalThreads = param.numThreads;
     cvQRequestNotFull = 0x00000003;  // these are identifier numbers
     cvQRequestFull = 0x00000002;
     mutexQRequest = 0x00000001;
+    cvRequesterBase = 0x00000100;    // 0x100, 0x101, ... one per requester
     hasJobInQueue = new bool[param.numThreads];  // using new because don't know how many threads
-    memset(hasJobInQueue, 0, sizeof(hasJobInQueue));
+    memset(hasJobInQueue, 0, sizeof(bool) * param.numThreads);
+    numInFlight = new int[param.numThreads]();
+    doneReading = new bool[param.numThreads]();
+    qCompletion = new std::deque<Request*>[param.numThreads];
+    isSleeping = new bool[param.numThreads]();
+    // parse every input file now, so that parsing never shows up while requests are being scheduled
+    arenas = new RequestArena[param.numThreads];
+    for (int i = 0; i < param.numThreads; i++) {
+        arenas[i] = loadRequests(param.threadName[i], i);
+        if (param.geometryModel && checkGeometry(arenas[i]) == false) {
+            std::cerr << "- Invalid Arguments." << std::endl;
+            return 0;
+        }
+    }
+    if (param.ringMode) {
+        ringInit(param.maxRequests);
+        credits.store(param.maxRequests);
+        ringCapacity.store(liveCapacity);
+        freeSlots = new std::atomic<int>[param.numThreads];
+        slotWaiting = new std::atomic<int>[param.numThreads];
+        for (int i = 0; i < param.numThreads; i++) {
+            freeSlots[i].store(param.maxInFlight[i]);
+            slotWaiting[i].store(0);
+        }
+        mutexRing = 0x00000004;
+    }
 
     // create main thread
     if (thread_libinit((thread_startfunc_t)threadMain, NULL)) {
@@ -1,12 +1,141 @@
 #include "thread.h"
+#include <signal.h>
+#include <time.h>
 #include <ucontext.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <deque>
 #include <iostream>
 #include <map>
+#include <vector>
 #include "interrupt.h"
+#ifdef __cpp_impl_coroutine
+#include "thread_task.h"
+#endif
+#if defined(THREAD_TRACE) || defined(THREAD_PROFILE)
+#include <x86intrin.h>
+#include <cstdio>
+#include <cstdlib>
+#endif
+#ifdef THREAD_PROFILE
+#include <execinfo.h>
+#endif
 using namespace std;
 
 #define DEBUG(x) cerr << x << endl
+#define THREAD_CACHE_SIZE 64  // finished threads whose TCB, context and stack are kept for reuse
+#define WAKE_SLOT_LIMIT 8  // runs from the next-to-run slot before the head of the ready queue gets a turn
+
+// Scheduler event tracing, compiled in with -DTHREAD_TRACE. Every thread records into its own ring of
+// TRACE_RING_EVENTS events, the oldest overwritten first, and all rings are written as Chrome trace JSON
+// (chrome://tracing, ui.perfetto.dev) to $THREAD_TRACE_FILE, or thread_trace.json, when the library exits.
+#ifdef THREAD_TRACE
+#define TRACE_RING_EVENTS 4096  // power of two
+#define TRACE(thread, type, arg) traceEvent(thread, type, arg)
+
+enum TraceType {
+    TRACE_RUN,   // switched to by the scheduler
+    TRACE_STOP,  // back in the scheduler
+    TRACE_CREATE,
+    TRACE_EXIT,
+    TRACE_YIELD,
+    TRACE_BLOCK_LOCK,
+    TRACE_WAIT_CV,
+    TRACE_WAKE,  // made another thread ready
+    TRACE_BLOCK_SYNC  // on a reader-writer lock, semaphore or barrier
+};
+
+struct TraceEvent {
+    unsigned long tsc;
+    unsigned int type;
+    unsigned int arg;  // lock, CV or thread ID
+};
+
+struct TraceRing {
+    unsigned int threadID;
+    unsigned long count;  // events ever recorded, the last TRACE_RING_EVENTS of them are kept
+    TraceEvent events[TRACE_RING_EVENTS];
+};
+#else
+#define TRACE(thread, type, arg)
+#endif
+
+// Lock profiling, compiled in with -DTHREAD_PROFILE. For every lock it counts acquisitions and contentions,
+// sums wait and hold times, and keeps up to PROFILE_SITES call sites that held it while others waited, each
+// with the stack of one of its acquisitions. A lock taken while holding another adds an edge to the lock order
+// graph. At exit, a report of all this, of the cycles in the graph and of the threads still blocked goes to
+// stderr; link with -rdynamic to get function names in the stacks. The cost is fixed per operation: a
+// timestamp and a scan of the few locks held, plus a backtrace() on the paths that block anyway and on the first
+// acquisitions of a contended lock from each site.
+#ifdef THREAD_PROFILE
+#define PROFILE_HELD 8          // locks held at once by a thread that are tracked
+#define PROFILE_SITES 4         // holder call sites kept per lock
+#define PROFILE_STACK_DEPTH 12  // frames, the first few inside the library
+#define PROFILE_EDGES 4096      // lock order edges, power of two
+#define PROFILE_CYCLES 16       // cycles reported at most
+#define PROFILE_SITE __builtin_return_address(0)
+#define PROFILE_BLOCK(what, id) profileBlock(what, id)
+
+struct HeldLock {
+    unsigned int lock;
+    int site;  // in the lock's sites, or -1
+    void* caller;
+    unsigned long acquiredAt;
+};
+
+struct ProfileSite {
+    void* caller;             // return address of the acquiring call
+    unsigned long blocked;    // threads that blocked while it held the lock
+    unsigned long holdTicks;
+    int depth;                // of stack, 0 until captured
+    void* stack[PROFILE_STACK_DEPTH];
+};
+
+struct LockProfile {
+    unsigned long acquisitions;
+    unsigned long contentions;
+    unsigned long waitTicks;
+    unsigned long maxWait;
+    unsigned long holdTicks;
+    unsigned long maxHold;
+    int siteCount;
+    ProfileSite sites[PROFILE_SITES];
+};
+
+struct OrderEdge {
+    unsigned int from;
+    unsigned int to;
+    unsigned long count;  // 0 for a free slot
+};
+#else
+#define PROFILE_SITE NULL
+#define PROFILE_BLOCK(what, id)
+#endif
+
+// Future structure, of thread_promise() or thread_async()
+struct Future {
+    bool ready;
+    void* value;
+    struct Thread* waiter;  // in thread_future_get(), NULL if none
+};
+
+// A function to run in a worker pool
+struct Job {
+    thread_startfunc_t func;
+    void* arg;
+};
+
+// Worker pool structure
+struct Pool {
+    unsigned int id;
+    deque<Job> qJobs;
+    deque<struct Thread*> qIdle;     // workers parked until a job comes
+    deque<struct Thread*> qWaiting;  // threads in thread_pool_wait()
+    vector<unsigned int> workers;    // thread IDs
+    unsigned int pending;            // jobs submitted and not finished
+    bool stopping;
+};
 
 // Thread TCB structure
 struct Thread {
@@ -14,12 +143,54 @@ struct Thread {
     ucontext_t* pucontext;
     char* stack;
     bool isFinished;
+    void* task;              // coroutine frame of a task from thread_create_task(), NULL for a thread
+    bool hasPendingLock;     // a task to be given pendingLock before it is resumed
+    unsigned int pendingLock;
+    deque<Thread*>* qJoiners;  // threads in thread_join() on this one, allocated by the first
+    Future* future;            // set to the result of func at exit, for thread_async()
+    void* specific[THREAD_KEYS_MAX];  // thread_setspecific() values
+#ifdef THREAD_TRACE
+    TraceRing* trace;
+#endif
+#ifdef THREAD_PROFILE
+    const char* blockedOn;  // what it is blocked on, NULL while running or ready
+    unsigned int blockedID;
+    unsigned long lockWaitStart;  // TSC when it blocked on a lock, 0 if it did not
+    int heldCount;
+    HeldLock held[PROFILE_HELD];
+    int blockedDepth;  // of blockedStack, where it blocked last
+    void* blockedStack[PROFILE_STACK_DEPTH];
+#endif
 };
 
 // Mutex lock structure
 struct Mutex {
     Thread* owner;
     deque<Thread*>* qBlocked;
+#ifdef THREAD_PROFILE
+    LockProfile profile;
+#endif
+};
+
+// Reader-writer lock structure
+struct RWLock {
+    Thread* writer;
+    unsigned int readers;  // read locks held
+    bool preferWriters;
+    deque<Thread*>* qReaders;
+    deque<Thread*>* qWriters;
+};
+
+// Counting semaphore structure
+struct Semaphore {
+    unsigned int value;
+    deque<Thread*>* qBlocked;
+};
+
+// Barrier structure
+struct Barrier {
+    unsigned int count;  // threads that complete it
+    deque<Thread*>* qArrived;
 };
 
 static bool init = false;                       // is this library instance initialized?
@@ -27,26 +198,478 @@ static int tid = 0;                             // threadID allocator
 static Thread* pthreadCurrent;                  // refers to the running(will run, exactly) user thread
 static ucontext_t* pscheduler;                  // pscheduler refers to the while-loop scheduler in thread_init()
 static deque<Thread*> qReady;                   // queue for ready threads
+static Thread* pthreadWoken = NULL;             // next-to-run slot, with wake affinity
+static bool wakeAffinity = false;
+static int slotRuns = 0;                        // threads run from the slot in a row
 static map<unsigned int, Mutex*> mLock;         // mutex lock table
 static map<unsigned int, deque<Thread*>*> mCV;  // conditional variable table
+static map<unsigned int, RWLock*> mRWLock;      // reader-writer lock table
+static map<unsigned int, Semaphore*> mSem;      // semaphore table
+static map<unsigned int, Barrier*> mBarrier;    // barrier table
+static map<unsigned int, Thread*> mThread;      // threads and tasks not finished yet, for thread_join()
+static map<unsigned int, Future*> mFuture;      // futures not got yet
+static vector<Thread*> threadCache;             // finished threads, to be reused by createThread()
+static map<unsigned int, Pool*> mPool;          // worker pool table
+static unsigned int futureID = 0;               // futureID allocator
+static unsigned int keyCount = 0;               // keys made by thread_key_create()
+static thread_destructor_t keyDestructors[THREAD_KEYS_MAX];
+static thread_stats_t libStats;                 // counters reported by thread_getstats()
+static volatile sig_atomic_t inCritical = 0;    // library code running, a quantum expiring now is deferred
+static volatile sig_atomic_t preemptPending = 0;
+static timer_t quantumTimer;
+static bool hasQuantumTimer = false;
+#ifdef THREAD_TRACE
+static vector<TraceRing*> traceRings;  // of every thread ever created, freed at exit
+#endif
+#if defined(THREAD_TRACE) || defined(THREAD_PROFILE)
+static unsigned long tscStart;  // at thread_libinit()
+static struct timespec tscStartTime;
+#endif
+#ifdef THREAD_PROFILE
+static OrderEdge profileEdges[PROFILE_EDGES];
+static unsigned long profileEdgesDropped = 0;
+#endif
+
+#if defined(THREAD_TRACE) || defined(THREAD_PROFILE)
+// TSC ticks per microsecond, measured since thread_libinit().
+static double tscPerUs() {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (end.tv_sec - tscStartTime.tv_sec) * 1e9 + (end.tv_nsec - tscStartTime.tv_nsec);
+    return ns > 0 ? (__rdtsc() - tscStart) / ns * 1000 : 1;
+}
+#endif
+
+//////////
+// tracing
+//////////
+
+#ifdef THREAD_TRACE
+// Give a new thread its ring.
+static void traceStart(Thread* pthread) {
+    pthread->trace = new TraceRing;  // kept after the thread exits, until the dump
+    pthread->trace->threadID = pthread->id;
+    pthread->trace->count = 0;
+    traceRings.push_back(pthread->trace);
+}
+
+static inline void traceEvent(Thread* pthread, TraceType type, unsigned int arg) {
+    TraceRing* ring = pthread->trace;
+    TraceEvent& event = ring->events[ring->count & (TRACE_RING_EVENTS - 1)];
+    event.tsc = __rdtsc();
+    event.type = type;
+    event.arg = arg;
+    ring->count++;
+}
+
+// Write every ring as Chrome trace JSON. The TSC is converted to time with the rate measured since
+// thread_libinit().
+static void traceDump() {
+    double ticksPerUs = tscPerUs();
+    const char* filename = getenv("THREAD_TRACE_FILE");
+    FILE* file = fopen(filename != NULL ? filename : "thread_trace.json", "w");
+    if (file == NULL) {
+        return;
+    }
+    static const char* names[] = {"run", "run", "create", "exit", "yield", "block lock", "wait cv", "wake",
+                                  "block sync"};
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (TraceRing* ring : traceRings) {
+        unsigned long begin = ring->count > TRACE_RING_EVENTS ? ring->count - TRACE_RING_EVENTS : 0;
+        for (unsigned long i = begin; i < ring->count; i++) {
+            TraceEvent& event = ring->events[i & (TRACE_RING_EVENTS - 1)];
+            const char* phase = event.type == TRACE_RUN ? "B" : (event.type == TRACE_STOP ? "E" : "i");
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u",
+                    first ? "" : ",\n", names[event.type], phase, (event.tsc - tscStart) / ticksPerUs,
+                    ring->threadID);
+            if (event.type > TRACE_STOP) {
+                fprintf(file, ",\"s\":\"t\",\"args\":{\"id\":%u}", event.arg);
+            }
+            fprintf(file, "}");
+            first = false;
+        }
+        delete ring;
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    traceRings.clear();
+}
+#endif
+
+////////////
+// profiling
+////////////
+
+#ifdef THREAD_PROFILE
+#define PROFILE_CONTENDED(mutex, lock) profileContended(mutex, lock)
+#define PROFILE_ACQUIRED(mutex, lock, caller) profileAcquired(mutex, lock, caller)
+#define PROFILE_RELEASED(mutex, lock) profileReleased(mutex, lock)
+
+static void profileStart(Thread* pthread) {
+    pthread->blockedOn = NULL;
+    pthread->lockWaitStart = 0;
+    pthread->heldCount = 0;
+    pthread->blockedDepth = 0;
+}
+
+// The current thread is about to block on what. Only called on paths that switch threads anyway.
+static void profileBlock(const char* what, unsigned int id) {
+    pthreadCurrent->blockedOn = what;
+    pthreadCurrent->blockedID = id;
+    pthreadCurrent->blockedDepth = backtrace(pthreadCurrent->blockedStack, PROFILE_STACK_DEPTH);
+}
+
+// Find the site of caller among the lock's, adding it if there is room. With capture, the current stack is
+// kept for a site without one.
+static int profileSite(LockProfile& profile, void* caller, bool capture) {
+    int site = 0;
+    while (site < profile.siteCount && profile.sites[site].caller != caller) {
+        site++;
+    }
+    if (site == profile.siteCount) {
+        if (site == PROFILE_SITES) {
+            return -1;
+        }
+        ProfileSite& added = profile.sites[profile.siteCount++];
+        added.caller = caller;
+        added.blocked = 0;
+        added.holdTicks = 0;
+        added.depth = 0;
+    }
+    if (capture && profile.sites[site].depth == 0) {
+        profile.sites[site].depth = backtrace(profile.sites[site].stack, PROFILE_STACK_DEPTH);
+    }
+    return site;
+}
+
+static void profileEdge(unsigned int from, unsigned int to) {
+    unsigned int hash = (from * 2654435761u) ^ (to * 40503u);
+    for (int probe = 0; probe < 16; probe++) {
+        OrderEdge& edge = profileEdges[(hash + probe) & (PROFILE_EDGES - 1)];
+        if (edge.count == 0) {
+            edge.from = from;
+            edge.to = to;
+        }
+        if (edge.from == from && edge.to == to) {
+            edge.count++;
+            return;
+        }
+    }
+    profileEdgesDropped++;
+}
+
+// The current thread is about to block on a lock held by another thread. The order edges are added now, in
+// case it never gets the lock.
+static void profileContended(Mutex* mutex, unsigned int lock) {
+    LockProfile& profile = mutex->profile;
+    profile.contentions++;
+    for (int i = 0; i < pthreadCurrent->heldCount; i++) {
+        profileEdge(pthreadCurrent->held[i].lock, lock);
+    }
+    Thread* owner = mutex->owner;
+    for (int i = 0; i < owner->heldCount; i++) {
+        HeldLock& held = owner->held[i];
+        if (held.lock == lock) {
+            if (held.site < 0) {
+                held.site = profileSite(profile, held.caller, false);  // the owner is not running, no stack
+            }
+            if (held.site >= 0) {
+                profile.sites[held.site].blocked++;
+            }
+            break;
+        }
+    }
+    pthreadCurrent->lockWaitStart = __rdtsc();
+    profileBlock("lock", lock);
+}
+
+// The current thread got the lock.
+static void profileAcquired(Mutex* mutex, unsigned int lock, void* caller) {
+    Thread* pthread = pthreadCurrent;
+    LockProfile& profile = mutex->profile;
+    unsigned long now = __rdtsc();
+    profile.acquisitions++;
+    if (pthread->lockWaitStart == 0) {  // else profileContended() added the edges
+        for (int i = 0; i < pthread->heldCount; i++) {
+            profileEdge(pthread->held[i].lock, lock);
+        }
+    } else {
+        unsigned long wait = now - pthread->lockWaitStart;
+        profile.waitTicks += wait;
+        profile.maxWait = wait > profile.maxWait ? wait : profile.maxWait;
+        pthread->lockWaitStart = 0;
+    }
+    if (pthread->heldCount < PROFILE_HELD) {
+        HeldLock& held = pthread->held[pthread->heldCount++];
+        held.lock = lock;
+        held.caller = caller;
+        held.site = profile.contentions > 0 ? profileSite(profile, caller, true) : -1;
+        held.acquiredAt = now;
+    }
+}
+
+// The current thread is releasing the lock.
+static void profileReleased(Mutex* mutex, unsigned int lock) {
+    Thread* pthread = pthreadCurrent;
+    for (int i = pthread->heldCount - 1; i >= 0; i--) {
+        if (pthread->held[i].lock == lock) {
+            LockProfile& profile = mutex->profile;
+            unsigned long hold = __rdtsc() - pthread->held[i].acquiredAt;
+            profile.holdTicks += hold;
+            profile.maxHold = hold > profile.maxHold ? hold : profile.maxHold;
+            if (pthread->held[i].site >= 0) {
+                profile.sites[pthread->held[i].site].holdTicks += hold;
+            }
+            pthread->held[i] = pthread->held[--pthread->heldCount];
+            return;
+        }
+    }
+}
+
+static void profilePrintStack(void* const* stack, int depth) {
+    char** symbols = backtrace_symbols(stack, depth);
+    for (int i = 0; i < depth; i++) {
+        fprintf(stderr, "        %s\n", symbols != NULL ? symbols[i] : "?");
+    }
+    free(symbols);
+}
+
+// Depth-first search of the lock order graph, reporting every edge back into path as a cycle.
+static void profileCycles(unsigned int lock, map<unsigned int, vector<unsigned int>>& graph,
+                          map<unsigned int, int>& state, vector<unsigned int>& path, int& found) {
+    state[lock] = 1;  // on path
+    path.push_back(lock);
+    for (unsigned int next : graph[lock]) {
+        if (state[next] == 1 && found < PROFILE_CYCLES) {
+            found++;
+            fprintf(stderr, "potential deadlock:");
+            size_t i = 0;
+            while (path[i] != next) {
+                i++;
+            }
+            for (; i < path.size(); i++) {
+                fprintf(stderr, " lock %u ->", path[i]);
+            }
+            fprintf(stderr, " lock %u\n", next);
+        } else if (state[next] == 0) {
+            profileCycles(next, graph, state, path, found);
+        }
+    }
+    path.pop_back();
+    state[lock] = 2;  // done
+}
+
+// Write the report to stderr when the library exits.
+static void profileReport() {
+    double ticksPerUs = tscPerUs();
+    fprintf(stderr, "lock profile:\n");
+    for (auto& entry : mLock) {
+        LockProfile& profile = entry.second->profile;
+        fprintf(stderr,
+                "lock %u: %lu acquisitions, %lu contended, wait %.1f us (max %.1f), hold %.1f us (max %.1f)\n",
+                entry.first, profile.acquisitions, profile.contentions, profile.waitTicks / ticksPerUs,
+                profile.maxWait / ticksPerUs, profile.holdTicks / ticksPerUs, profile.maxHold / ticksPerUs);
+        for (int i = 0; i < profile.siteCount; i++) {
+            ProfileSite& site = profile.sites[i];
+            fprintf(stderr, "    held from %p: %lu threads blocked, %.1f us held\n", site.caller, site.blocked,
+                    site.holdTicks / ticksPerUs);
+            profilePrintStack(site.stack, site.depth);
+        }
+    }
+
+    map<unsigned int, vector<unsigned int>> graph;
+    for (OrderEdge& edge : profileEdges) {
+        if (edge.count > 0) {
+            graph[edge.from].push_back(edge.to);
+        }
+    }
+    map<unsigned int, int> state;
+    vector<unsigned int> path;
+    int found = 0;
+    for (auto& entry : graph) {
+        if (state[entry.first] == 0) {
+            profileCycles(entry.first, graph, state, path, found);
+        }
+    }
+    if (profileEdgesDropped > 0) {
+        fprintf(stderr, "%lu lock order edges not recorded, the table is full\n", profileEdgesDropped);
+    }
+
+    for (auto& entry : mThread) {
+        Thread* pthread = entry.second;
+        if (pthread->isFinished || pthread->blockedOn == NULL) {
+            continue;
+        }
+        fprintf(stderr, "thread %u blocked on %s %u", pthread->id, pthread->blockedOn, pthread->blockedID);
+        auto iter = mLock.find(pthread->blockedID);
+        if (string(pthread->blockedOn) == "lock" && iter != mLock.end() && iter->second->owner != NULL) {
+            fprintf(stderr, " held by thread %u", iter->second->owner->id);
+        }
+        fprintf(stderr, "\n");
+        profilePrintStack(pthread->blockedStack, pthread->blockedDepth);
+    }
+}
+#else
+#define PROFILE_CONTENDED(mutex, lock)
+#define PROFILE_ACQUIRED(mutex, lock, caller)
+#define PROFILE_RELEASED(mutex, lock)
+#endif
+
+/////////////
+// preemption
+/////////////
+
+// Every library call runs between maskInterrupts() and unmaskInterrupts(). Besides the simulated interrupt
+// mask of libinterrupt.a, they keep inCritical for the quantum timer of thread_set_quantum(), which only
+// takes a flag store. Built with -DTHREAD_FAST_MASK, the flag is the only mask: libinterrupt.a is not called,
+// and start_preemptions() must not be used.
+static void preempt() {
+    if (pthreadCurrent != NULL && pthreadCurrent->task == NULL) {  // tasks are not preempted
+        libStats.preemptions++;
+        thread_yield();
+    }
+}
+
+// inCritical is raised before interrupt_disable() and dropped only after interrupt_enable(), so a quantum
+// never switches threads while libinterrupt.a is half way through changing its own mask.
+static inline void maskInterrupts() {
+    inCritical = 1;
+    std::atomic_signal_fence(std::memory_order_seq_cst);  // keep the critical section after the store
+#ifndef THREAD_FAST_MASK
+    interrupt_disable();
+#endif
+}
+
+static inline void unmaskInterrupts() {
+#ifndef THREAD_FAST_MASK
+    interrupt_enable();
+#endif
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    inCritical = 0;
+    if (preemptPending) {
+        // the quantum expired in the critical section
+        preemptPending = 0;
+        preempt();
+    }
+}
+
+static void quantumExpired(int signal) {
+    if (inCritical) {
+        preemptPending = 1;
+        return;
+    }
+    int savedErrno = errno;
+    preempt();
+    errno = savedErrno;
+}
 
 ///////
 // func
 ///////
 
+// Make a woken thread ready. With wake affinity it takes the next-to-run slot, and a thread already there
+// goes to the tail of the queue.
+static void makeReady(Thread* pthread) {
+    if (wakeAffinity) {
+        if (pthreadWoken != NULL) {
+            qReady.push_back(pthreadWoken);
+        }
+        pthreadWoken = pthread;
+    } else {
+        qReady.push_back(pthread);
+    }
+    libStats.wakeups++;
+    TRACE(pthreadCurrent, TRACE_WAKE, pthread->id);
+}
+
+// Take the thread to run next. The slot goes first, but at most WAKE_SLOT_LIMIT times in a row, so that a
+// pair of threads waking each other cannot starve the queue.
+static Thread* nextReady() {
+    Thread* pthread;
+    if (pthreadWoken != NULL && (slotRuns < WAKE_SLOT_LIMIT || qReady.empty())) {
+        pthread = pthreadWoken;
+        pthreadWoken = NULL;
+        slotRuns++;
+    } else {
+        pthread = qReady.front();
+        qReady.pop_front();
+        slotRuns = 0;
+    }
+    return pthread;
+}
+
+// Give value to the future and to the thread waiting for it. Interrupts are disabled.
+static void setFuture(Future* future, void* value) {
+    future->ready = true;
+    future->value = value;
+    if (future->waiter != NULL) {
+        makeReady(future->waiter);
+        future->waiter = NULL;
+    }
+}
+
+// Mark current thread as finished, and wake the threads joining it. Interrupts are disabled.
+static void finishCurrentThread() {
+    pthreadCurrent->isFinished = true;
+    TRACE(pthreadCurrent, TRACE_EXIT, pthreadCurrent->id);
+    mThread.erase(pthreadCurrent->id);
+    if (pthreadCurrent->qJoiners != NULL) {
+        for (Thread* pthread : *pthreadCurrent->qJoiners) {
+            makeReady(pthread);
+        }
+        delete pthreadCurrent->qJoiners;
+        pthreadCurrent->qJoiners = NULL;
+    }
+}
+
+// Call the key destructors for the current thread's values, with interrupts enabled.
+static void destroySpecific() {
+    for (unsigned int key = 0; key < keyCount; key++) {
+        void* value = pthreadCurrent->specific[key];
+        if (value != NULL && keyDestructors[key] != NULL) {
+            pthreadCurrent->specific[key] = NULL;
+            keyDestructors[key](value);
+        }
+    }
+}
+
 // Execute current thread in context `func` with parameter `arg`.
 static void start(thread_startfunc_t func, void* arg) {
     // allow interruption, exec func, and disaable interruption again
-    interrupt_enable();
-    func(arg);
-    interrupt_disable();
+    unmaskInterrupts();
+    if (pthreadCurrent->future != NULL) {
+        // func is really a thread_resultfunc_t, from thread_async()
+        void* value = ((thread_resultfunc_t)func)(arg);
+        destroySpecific();
+        maskInterrupts();
+        setFuture(pthreadCurrent->future, value);
+    } else {
+        func(arg);
+        destroySpecific();
+        maskInterrupts();
+    }
     // mark this thread as finished
-    pthreadCurrent->isFinished = true;
+    finishCurrentThread();
     swapcontext(pthreadCurrent->pucontext, pscheduler);
 }
 
 // Recycle any resources associated to current thread.
 static void deleteCurrentThread() {
+    if (pthreadCurrent->task != NULL) {
+#ifdef __cpp_impl_coroutine
+        std::coroutine_handle<>::from_address(pthreadCurrent->task).destroy();
+#endif
+        delete pthreadCurrent;
+        pthreadCurrent = NULL;
+        return;
+    }
+    if (threadCache.size() < THREAD_CACHE_SIZE) {
+        // keep it whole, createThread() only has to point its context to start() again
+        threadCache.push_back(pthreadCurrent);
+        pthreadCurrent = NULL;
+        return;
+    }
     delete pthreadCurrent->stack;
     pthreadCurrent->pucontext->uc_stack.ss_sp = NULL;
     pthreadCurrent->pucontext->uc_stack.ss_size = 0;
@@ -57,6 +680,35 @@ static void deleteCurrentThread() {
     pthreadCurrent = NULL;
 }
 
+// Before a task returns from a co_await that has to reacquire a lock, give the lock to it. Returns false,
+// with the task blocked on the lock, if another thread holds it.
+static bool takePendingLock(Thread* pthread) {
+    if (pthread->hasPendingLock == false) {
+        return true;
+    }
+    Mutex* mutex = mLock[pthread->pendingLock];
+    if (mutex->owner != NULL && mutex->owner != pthread) {
+        TRACE(pthread, TRACE_BLOCK_LOCK, pthread->pendingLock);
+        PROFILE_CONTENDED(mutex, pthread->pendingLock);  // pthread is current
+        mutex->qBlocked->push_back(pthread);
+        return false;
+    }
+    mutex->owner = pthread;  // free, or handed over by thread_unlock()
+    pthread->hasPendingLock = false;
+    libStats.locks++;
+    PROFILE_ACQUIRED(mutex, pthread->pendingLock, NULL);
+    return true;
+}
+
+// Run a task on the scheduler's stack until its next co_await suspends it. The awaiters disable interrupts
+// again before they suspend.
+static void runTask(Thread* pthread) {
+#ifdef __cpp_impl_coroutine
+    unmaskInterrupts();
+    std::coroutine_handle<>::from_address(pthread->task).resume();
+#endif
+}
+
 /////////////////
 // thread library
 /////////////////
@@ -89,25 +741,50 @@ int thread_libinit(thread_startfunc_t func, void* arg) {
 
     getcontext(pscheduler);  // initialize pscheduler by copying current context
 
-    interrupt_disable();
+#if defined(THREAD_TRACE) || defined(THREAD_PROFILE)
+    tscStart = __rdtsc();
+    clock_gettime(CLOCK_MONOTONIC, &tscStartTime);
+#endif
+    maskInterrupts();
+    libStats.switches++;
+    TRACE(pthreadInit, TRACE_RUN, 0);
     swapcontext(pscheduler, pthreadInit->pucontext);  // save current context (this scheduler) into pscheduler, then switch to pucontext
+    TRACE(pthreadCurrent, TRACE_STOP, 0);
 
-    while (qReady.empty() == false) {
+    while (qReady.empty() == false || pthreadWoken != NULL) {
         if (pthreadCurrent->isFinished == true) {
             // recycle current thread context
             deleteCurrentThread();
         }
         // if returned to this scheduler, switch to next thread
-        Thread* pthreadNext = qReady.front();
-        qReady.pop_front();
+        Thread* pthreadNext = nextReady();
         pthreadCurrent = pthreadNext;
-        swapcontext(pscheduler, pthreadCurrent->pucontext);  // return to the running thread
+        if (pthreadCurrent->task != NULL && takePendingLock(pthreadCurrent) == false) {
+            continue;
+        }
+#ifdef THREAD_PROFILE
+        pthreadCurrent->blockedOn = NULL;
+#endif
+        libStats.switches++;
+        TRACE(pthreadCurrent, TRACE_RUN, 0);
+        if (pthreadCurrent->task != NULL) {
+            runTask(pthreadCurrent);
+        } else {
+            swapcontext(pscheduler, pthreadCurrent->pucontext);  // return to the running thread
+        }
+        TRACE(pthreadCurrent, TRACE_STOP, 0);
     }
 
+#ifdef THREAD_PROFILE
+    profileReport();  // before the last thread is deleted, it may be one of those blocked
+#endif
     if (pthreadCurrent != NULL) {
         // recycle current(last) thread context
         deleteCurrentThread();
     }
+#ifdef THREAD_TRACE
+    traceDump();
+#endif
 
     // theoretically should do this
     // interrupt_enable();
@@ -117,24 +794,27 @@ int thread_libinit(thread_startfunc_t func, void* arg) {
     exit(0);
 }
 
-int thread_create(thread_startfunc_t func, void* arg) {
-    if (init == false) {
-        // cerr << "- Must call thread_libinit() before thread_create()." << endl;
-        return -1;
-    }
-
-    Thread* pthread;
-
-    interrupt_disable();
+// Create a thread running func(arg), and return its ID in *id if asked. Interrupts are disabled.
+static int createThread(thread_startfunc_t func, void* arg, Future* future, unsigned int* id) {
+    Thread* pthread = NULL;
 
     try {
-        // make a new thread and its context
-        pthread = new Thread;
-        pthread->pucontext = new ucontext_t;
-        getcontext(pthread->pucontext);  // "Initialize a context structure by copying the current thread's context."
-        // "Direct the new thread to use a different stack."
-        // "Your thread library should allocate STACK_SIZE bytes for each thread's stack."
-        pthread->stack = new char[STACK_SIZE];
+        if (threadCache.empty() == false) {
+            // reuse a finished thread, its context was initialized by getcontext() when it was made
+            pthread = threadCache.back();
+            threadCache.pop_back();
+        } else {
+            // make a new thread and its context
+            pthread = new Thread;
+            pthread->pucontext = NULL;
+            pthread->stack = NULL;
+            pthread->pucontext = new ucontext_t;
+            // "Initialize a context structure by copying the current thread's context."
+            getcontext(pthread->pucontext);
+            // "Direct the new thread to use a different stack."
+            // "Your thread library should allocate STACK_SIZE bytes for each thread's stack."
+            pthread->stack = new char[STACK_SIZE];
+        }
         pthread->pucontext->uc_stack.ss_sp = pthread->stack;
         pthread->pucontext->uc_stack.ss_size = STACK_SIZE;
         pthread->pucontext->uc_stack.ss_flags = 0;
@@ -146,67 +826,124 @@ int thread_create(thread_startfunc_t func, void* arg) {
         pthread->id = tid;
         tid++;
         pthread->isFinished = false;
+        pthread->task = NULL;
+        pthread->hasPendingLock = false;
+        pthread->qJoiners = NULL;
+        pthread->future = future;
+        std::fill(pthread->specific, pthread->specific + THREAD_KEYS_MAX, (void*)NULL);
+        mThread.insert(std::make_pair(pthread->id, pthread));
+#ifdef THREAD_TRACE
+        traceStart(pthread);
+        TRACE(pthread, TRACE_CREATE, pthreadCurrent != NULL ? pthreadCurrent->id : pthread->id);
+#endif
+#ifdef THREAD_PROFILE
+        profileStart(pthread);
+#endif
         qReady.push_back(pthread);  // append the new thread into ready queue
     } catch (std::bad_alloc err) {
-        delete pthread->pucontext;
-        delete pthread->stack;
-        delete pthread;
+        if (pthread != NULL) {
+            delete pthread->pucontext;
+            delete pthread->stack;
+            delete pthread;
+        }
+        return -1;
+    }
+
+    if (id != NULL) {
+        *id = pthread->id;
+    }
+    return 0;
+}
+
+int thread_create(thread_startfunc_t func, void* arg) {
+    return thread_create_id(func, arg, NULL);
+}
 
-        interrupt_enable();
+int thread_create_n(thread_startfunc_t func, void** args, unsigned int count) {
+    if (init == false) {
         return -1;
     }
 
-    interrupt_enable();
+    maskInterrupts();  // once for the batch
+    for (unsigned int i = 0; i < count; i++) {
+        void* arg = args != NULL ? args[i] : (void*)(long)i;
+        if (createThread(func, arg, NULL, NULL) != 0) {
+            unmaskInterrupts();
+            return -1;
+        }
+    }
+    unmaskInterrupts();
     return 0;
 }
 
+int thread_create_id(thread_startfunc_t func, void* arg, unsigned int* id) {
+    if (init == false) {
+        // cerr << "- Must call thread_libinit() before thread_create()." << endl;
+        return -1;
+    }
+
+    maskInterrupts();
+    int result = createThread(func, arg, NULL, id);
+    unmaskInterrupts();
+    return result;
+}
+
 int thread_yield(void) {
     if (init == false) {
         // cerr << "- Must call thread_libinit() before thread_yield()." << endl;
         return -1;
     }
+    if (pthreadCurrent->task != NULL) {
+        return 0;  // a task only gives up the CPU at co_await thread_co_yield()
+    }
 
-    interrupt_disable();
+    maskInterrupts();
+    TRACE(pthreadCurrent, TRACE_YIELD, 0);
     qReady.push_back(pthreadCurrent);
     swapcontext(pthreadCurrent->pucontext, pscheduler);  // return to the scheduler
-    interrupt_enable();
+    unmaskInterrupts();
 
     return 0;
 }
 
-int thread_lock(unsigned int lock) {
+// thread_lock() called from caller, which the profiler records as the holder's call site.
+static int lockAt(unsigned int lock, void* caller) {
     if (init == false) {
         // cerr << "- Must call thread_libinit() before thread_lock()." << endl;
         return -1;
     }
 
-    interrupt_disable();
+    maskInterrupts();
 
     auto iter = mLock.find(lock);
     if (iter == mLock.end()) {
         // lock doesn't exist yet. this shall be a new lock
         Mutex* mutex = NULL;
         try {
-            mutex = new Mutex;
+            mutex = new Mutex();
             mutex->owner = pthreadCurrent;
             mutex->qBlocked = new deque<Thread*>;
         } catch (std::bad_alloc err) {
             delete mutex->qBlocked;
             delete mutex;
-            interrupt_enable();
+            unmaskInterrupts();
             return -1;
         }
         mLock.insert(std::make_pair(lock, mutex));
+        libStats.locks++;
+        PROFILE_ACQUIRED(mutex, lock, caller);
 
-        interrupt_enable();
+        unmaskInterrupts();
         return 0;  // normal return
     } else {
         Mutex* mutex = iter->second;
         if (mutex->owner == NULL) {
             // a previous unlocked lock being locked again
             mutex->owner = pthreadCurrent;
+            libStats.locks++;
+            PROFILE_ACQUIRED(mutex, lock, caller);
 
-            interrupt_enable();
+            unmaskInterrupts();
             return 0;
         } else {
             if (mutex->owner->id == pthreadCurrent->id) {
@@ -214,14 +951,22 @@ int thread_lock(unsigned int lock) {
                 // "trying to acquire a lock by a thread that already has the lock IS an error."
                 // cerr << "- Lock # " << lock << " has already locked. Waiting a lock held by the thread itself could cause DEADLOCK." << endl;
 
-                interrupt_enable();
+                unmaskInterrupts();
                 return -1;  // error
+            } else if (pthreadCurrent->task != NULL) {
+                // a task has no context to block in, it has to co_await thread_co_lock()
+                unmaskInterrupts();
+                return -1;
             } else {
                 // waiting a lock
+                TRACE(pthreadCurrent, TRACE_BLOCK_LOCK, lock);
+                PROFILE_CONTENDED(mutex, lock);
                 mutex->qBlocked->push_back(pthreadCurrent);  // current thread is waiting for this lock
                 swapcontext(pthreadCurrent->pucontext, pscheduler);
+                libStats.locks++;  // ownership was handed over by thread_unlock()
+                PROFILE_ACQUIRED(mutex, lock, caller);
 
-                interrupt_enable();
+                unmaskInterrupts();
                 return 0;  // normal return
             }
         }
@@ -229,20 +974,24 @@ int thread_lock(unsigned int lock) {
     return 0;
 }
 
+int thread_lock(unsigned int lock) {
+    return lockAt(lock, PROFILE_SITE);
+}
+
 int thread_unlock(unsigned int lock) {
     if (init == false) {
         // cerr << "- Must call thread_libinit() before thread_unlock()." << endl;
         return -1;
     }
 
-    interrupt_disable();
+    maskInterrupts();
 
     auto iter = mLock.find(lock);
     if (iter == mLock.end()) {
         // lock not found
         // cerr << "- Lock # " << lock << " does NOT EXIST." << endl;
 
-        interrupt_enable();
+        unmaskInterrupts();
         return -1;  // error
     } else {
         Mutex* mutex = iter->second;
@@ -250,26 +999,27 @@ int thread_unlock(unsigned int lock) {
             // lock held by nobody. Theoretically this will not happen
             // cerr << "- Lock # " << lock << " is not hold by any thread." << endl;
 
-            interrupt_enable();
+            unmaskInterrupts();
             return -1;  // error
         } else if (mutex->owner->id != pthreadCurrent->id) {
             // current thread does not own this lock: trying to unlock other's lock
             // cerr << "- Lock #" << lock << " is not hold by this thread, thus cannot be unlocked by it." << endl;
 
-            interrupt_enable();
+            unmaskInterrupts();
             return -1;  // error
         } else {
             // expected situation: lock held by itself
+            PROFILE_RELEASED(mutex, lock);
             if (mutex->qBlocked->empty() == false) {
                 // has waiting thread
                 mutex->owner = mutex->qBlocked->front();
                 mutex->qBlocked->pop_front();
-                qReady.push_back(mutex->owner);
+                makeReady(mutex->owner);
             } else {
                 // has no waiting thread
                 mutex->owner = NULL;
             }
-            interrupt_enable();
+            unmaskInterrupts();
             return 0;  // normal return
         }
     }
@@ -296,11 +1046,12 @@ int thread_unlock_with_interrupt_disabled(unsigned int lock) {
             return -1;  // error
         } else {
             // expected situation: lock held by itself
+            PROFILE_RELEASED(mutex, lock);
             if (mutex->qBlocked->empty() == false) {
                 // has waiting thread
                 mutex->owner = mutex->qBlocked->front();
                 mutex->qBlocked->pop_front();
-                qReady.push_back(mutex->owner);
+                makeReady(mutex->owner);
             } else {
                 // has no waiting thread
                 mutex->owner = NULL;
@@ -317,13 +1068,16 @@ int thread_wait(unsigned int lock, unsigned int cond) {
         // cerr << "- Must call thread_libinit() before thread_wait()." << endl;
         return -1;
     }
+    if (pthreadCurrent->task != NULL) {
+        return -1;  // a task has to co_await thread_co_wait()
+    }
 
-    interrupt_disable();
+    maskInterrupts();
 
     // unlock the lock at first. This will disable interrupt and enable again.
     if (thread_unlock_with_interrupt_disabled(lock) != 0) {
         // cerr << "- FAILED to unlock lock # " << lock << " while waiting for Conditional Variable # " << cond << "." << endl;
-        interrupt_enable();
+        unmaskInterrupts();
         return -1;  // error
     } else {
         // lock was unlocked. wait cv
@@ -337,7 +1091,7 @@ int thread_wait(unsigned int lock, unsigned int cond) {
             } catch (std::bad_alloc err) {
                 delete qthreadWaiting;
 
-                interrupt_enable();
+                unmaskInterrupts();
                 return -1;
             }
             qthreadWaiting->push_back(pthreadCurrent);
@@ -349,12 +1103,14 @@ int thread_wait(unsigned int lock, unsigned int cond) {
             iter->second->push_back(pthreadCurrent);
         }
         // swapcontext(pscheduler, pthreadCurrent->pucontext);
+        TRACE(pthreadCurrent, TRACE_WAIT_CV, cond);
+        PROFILE_BLOCK("cv", cond);
         swapcontext(pthreadCurrent->pucontext, pscheduler);
 
-        interrupt_enable();
+        unmaskInterrupts();
 
         // lock the lock at last
-        if (thread_lock(lock) != 0) {
+        if (lockAt(lock, PROFILE_SITE) != 0) {
             // cerr << "- FAILED to lock lock # " << lock << " while waiting for Conditional Variable # " << cond << "." << endl;
             return -1;
         } else {
@@ -369,14 +1125,14 @@ int thread_signal(unsigned int lock, unsigned int cond) {
         return -1;
     }
 
-    interrupt_disable();
+    maskInterrupts();
 
     auto iter = mCV.find(cond);
     if (iter == mCV.end()) {
         // cv not found
         // cerr << "- CV # " << cond << " is not hold by any thread." << endl;
 
-        interrupt_enable();
+        unmaskInterrupts();
         return 0;  // Not an error: "signaling without holding the lock (this is explicitly NOT an error in Mesa monitors)"
     } else {
         deque<Thread*>* qthreadWaiting = iter->second;
@@ -384,13 +1140,13 @@ int thread_signal(unsigned int lock, unsigned int cond) {
             // cv held by this thread
             Thread* pthread = qthreadWaiting->front();
             qthreadWaiting->pop_front();
-            qReady.push_back(pthread);
+            makeReady(pthread);
 
-            interrupt_enable();
+            unmaskInterrupts();
             return 0;  // normal return
         } else {
             // signaling a cv with nobody waiting - this is normal behavior
-            interrupt_enable();
+            unmaskInterrupts();
             return 0;  // normal return
         }
     }
@@ -403,12 +1159,12 @@ int thread_broadcast(unsigned int lock, unsigned int cond) {
         return -1;
     }
 
-    interrupt_disable();
+    maskInterrupts();
 
     auto iter = mCV.find(cond);
     if (iter == mCV.end()) {
         // cv not found
-        interrupt_enable();
+        unmaskInterrupts();
         return 0;  // Not an error: signaling without holding the lock (this is explicitly NOT an error in Mesa monitors)
     } else {
         // cv found
@@ -416,10 +1172,761 @@ int thread_broadcast(unsigned int lock, unsigned int cond) {
         while (qthreadWaiting->empty() == false) {
             Thread* pthread = qthreadWaiting->front();
             qthreadWaiting->pop_front();
-            qReady.push_back(pthread);
+            makeReady(pthread);
         }
     }
 
-    interrupt_enable();
+    unmaskInterrupts();
+    return 0;
+}
+
+////////////////////////////////////////////
+// reader-writer locks, semaphores, barriers
+////////////////////////////////////////////
+
+// Block the current thread on queue until another thread gives it what it waits for and makes it ready.
+// Interrupts are disabled. Returns -1 in a task, which cannot block here.
+static int block(deque<Thread*>* queue, const char* what, unsigned int id) {
+    if (pthreadCurrent->task != NULL) {
+        return -1;
+    }
+    TRACE(pthreadCurrent, TRACE_BLOCK_SYNC, id);
+    PROFILE_BLOCK(what, id);
+    queue->push_back(pthreadCurrent);
+    swapcontext(pthreadCurrent->pucontext, pscheduler);
+    return 0;
+}
+
+// Find a reader-writer lock, creating it if asked to. Interrupts are disabled.
+static RWLock* findRWLock(unsigned int rwlock, bool create, bool preferWriters) {
+    auto iter = mRWLock.find(rwlock);
+    if (iter != mRWLock.end()) {
+        return iter->second;
+    } else if (create == false) {
+        return NULL;
+    }
+    RWLock* rw = NULL;
+    try {
+        rw = new RWLock;
+        rw->writer = NULL;
+        rw->readers = 0;
+        rw->preferWriters = preferWriters;
+        rw->qReaders = NULL;
+        rw->qWriters = NULL;
+        rw->qReaders = new deque<Thread*>;
+        rw->qWriters = new deque<Thread*>;
+        mRWLock.insert(std::make_pair(rwlock, rw));
+    } catch (std::bad_alloc err) {
+        if (rw != NULL) {
+            delete rw->qReaders;
+            delete rw->qWriters;
+        }
+        delete rw;
+        return NULL;
+    }
+    return rw;
+}
+
+int thread_rwlock_init(unsigned int rwlock, bool prefer_writers) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    RWLock* rw = findRWLock(rwlock, true, prefer_writers);
+    if (rw == NULL) {
+        unmaskInterrupts();
+        return -1;
+    }
+    rw->preferWriters = prefer_writers;
+    unmaskInterrupts();
     return 0;
-}
\ No newline at end of file
+}
+
+int thread_rwlock_rdlock(unsigned int rwlock) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    RWLock* rw = findRWLock(rwlock, true, true);
+    int result = 0;
+    if (rw == NULL || rw->writer == pthreadCurrent) {
+        result = -1;  // reading under its own write lock would deadlock
+    } else if (rw->writer == NULL && (rw->preferWriters == false || rw->qWriters->empty())) {
+        rw->readers++;
+    } else {
+        result = block(rw->qReaders, "rwlock", rwlock);  // counted in readers by the unlock that wakes it
+    }
+    unmaskInterrupts();
+    return result;
+}
+
+int thread_rwlock_wrlock(unsigned int rwlock) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    RWLock* rw = findRWLock(rwlock, true, true);
+    int result = 0;
+    if (rw == NULL || rw->writer == pthreadCurrent) {
+        result = -1;
+    } else if (rw->writer == NULL && rw->readers == 0) {
+        rw->writer = pthreadCurrent;
+    } else {
+        result = block(rw->qWriters, "rwlock", rwlock);  // made writer by the unlock that wakes it
+    }
+    unmaskInterrupts();
+    return result;
+}
+
+int thread_rwlock_unlock(unsigned int rwlock) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    RWLock* rw = findRWLock(rwlock, false, true);
+    if (rw == NULL || (rw->writer != pthreadCurrent && rw->readers == 0)) {
+        unmaskInterrupts();
+        return -1;  // not held
+    }
+    if (rw->writer == pthreadCurrent) {
+        rw->writer = NULL;
+    } else {
+        rw->readers--;
+    }
+    if (rw->writer == NULL && rw->readers == 0) {
+        // hand the lock over: to one writer, or to every waiting reader at once
+        bool toWriter = rw->qWriters->empty() == false && (rw->preferWriters || rw->qReaders->empty());
+        if (toWriter) {
+            rw->writer = rw->qWriters->front();
+            rw->qWriters->pop_front();
+            makeReady(rw->writer);
+        } else {
+            while (rw->qReaders->empty() == false) {
+                rw->readers++;
+                makeReady(rw->qReaders->front());
+                rw->qReaders->pop_front();
+            }
+        }
+    }
+    unmaskInterrupts();
+    return 0;
+}
+
+int thread_sem_init(unsigned int sem, unsigned int value) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    auto iter = mSem.find(sem);
+    if (iter != mSem.end()) {
+        if (iter->second->qBlocked->empty() == false) {
+            unmaskInterrupts();
+            return -1;  // threads are waiting on it
+        }
+        iter->second->value = value;
+        unmaskInterrupts();
+        return 0;
+    }
+    Semaphore* semaphore = NULL;
+    try {
+        semaphore = new Semaphore;
+        semaphore->value = value;
+        semaphore->qBlocked = new deque<Thread*>;
+        mSem.insert(std::make_pair(sem, semaphore));
+    } catch (std::bad_alloc err) {
+        delete semaphore;
+        unmaskInterrupts();
+        return -1;
+    }
+    unmaskInterrupts();
+    return 0;
+}
+
+int thread_sem_wait(unsigned int sem) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    auto iter = mSem.find(sem);
+    int result = 0;
+    if (iter == mSem.end()) {
+        result = -1;
+    } else if (iter->second->value > 0) {
+        iter->second->value--;
+    } else {
+        result = block(iter->second->qBlocked, "semaphore", sem);  // thread_sem_post() passes its unit to it
+    }
+    unmaskInterrupts();
+    return result;
+}
+
+int thread_sem_post(unsigned int sem) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    auto iter = mSem.find(sem);
+    if (iter == mSem.end()) {
+        unmaskInterrupts();
+        return -1;
+    }
+    Semaphore* semaphore = iter->second;
+    if (semaphore->qBlocked->empty() == false) {
+        makeReady(semaphore->qBlocked->front());
+        semaphore->qBlocked->pop_front();
+    } else {
+        semaphore->value++;
+    }
+    unmaskInterrupts();
+    return 0;
+}
+
+int thread_barrier_init(unsigned int barrier, unsigned int count) {
+    if (init == false || count == 0) {
+        return -1;
+    }
+
+    maskInterrupts();
+    auto iter = mBarrier.find(barrier);
+    if (iter != mBarrier.end()) {
+        if (iter->second->qArrived->empty() == false) {
+            unmaskInterrupts();
+            return -1;  // threads are waiting on it
+        }
+        iter->second->count = count;
+        unmaskInterrupts();
+        return 0;
+    }
+    Barrier* pbarrier = NULL;
+    try {
+        pbarrier = new Barrier;
+        pbarrier->count = count;
+        pbarrier->qArrived = new deque<Thread*>;
+        mBarrier.insert(std::make_pair(barrier, pbarrier));
+    } catch (std::bad_alloc err) {
+        delete pbarrier;
+        unmaskInterrupts();
+        return -1;
+    }
+    unmaskInterrupts();
+    return 0;
+}
+
+int thread_barrier_wait(unsigned int barrier) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    auto iter = mBarrier.find(barrier);
+    int result = 0;
+    if (iter == mBarrier.end()) {
+        result = -1;
+    } else if (iter->second->qArrived->size() + 1 < iter->second->count) {
+        result = block(iter->second->qArrived, "barrier", barrier);
+    } else {
+        // the last one to arrive releases the others
+        deque<Thread*>* qArrived = iter->second->qArrived;
+        while (qArrived->empty() == false) {
+            makeReady(qArrived->front());
+            qArrived->pop_front();
+        }
+        result = 1;
+    }
+    unmaskInterrupts();
+    return result;
+}
+
+//////////////////////////
+// join, futures, promises
+//////////////////////////
+
+int thread_self(void) {
+    if (init == false) {
+        return -1;
+    }
+    return pthreadCurrent->id;
+}
+
+int thread_join(unsigned int thread) {
+    if (init == false || thread == pthreadCurrent->id) {
+        return -1;
+    }
+
+    maskInterrupts();
+    auto iter = mThread.find(thread);
+    if (iter == mThread.end()) {
+        unmaskInterrupts();
+        return thread < (unsigned int)tid ? 0 : -1;  // finished already, or never created
+    }
+    Thread* pthread = iter->second;
+    int result = 0;
+    try {
+        if (pthread->qJoiners == NULL) {
+            pthread->qJoiners = new deque<Thread*>;
+        }
+        result = block(pthread->qJoiners, "thread", thread);  // woken by finishCurrentThread()
+    } catch (std::bad_alloc err) {
+        result = -1;
+    }
+    unmaskInterrupts();
+    return result;
+}
+
+// Create an unset future. Interrupts are disabled.
+static Future* createFuture(unsigned int* future) {
+    Future* pfuture = NULL;
+    try {
+        pfuture = new Future;
+        pfuture->ready = false;
+        pfuture->value = NULL;
+        pfuture->waiter = NULL;
+        mFuture.insert(std::make_pair(futureID, pfuture));
+    } catch (std::bad_alloc err) {
+        delete pfuture;
+        return NULL;
+    }
+    *future = futureID;
+    futureID++;
+    return pfuture;
+}
+
+int thread_promise(unsigned int* future) {
+    if (init == false || future == NULL) {
+        return -1;
+    }
+
+    maskInterrupts();
+    Future* pfuture = createFuture(future);
+    unmaskInterrupts();
+    return pfuture != NULL ? 0 : -1;
+}
+
+int thread_promise_set(unsigned int future, void* value) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    auto iter = mFuture.find(future);
+    if (iter == mFuture.end() || iter->second->ready) {
+        unmaskInterrupts();
+        return -1;  // set twice
+    }
+    setFuture(iter->second, value);
+    unmaskInterrupts();
+    return 0;
+}
+
+int thread_async(thread_resultfunc_t func, void* arg, unsigned int* future) {
+    if (init == false || future == NULL) {
+        return -1;
+    }
+
+    maskInterrupts();
+    Future* pfuture = createFuture(future);
+    if (pfuture == NULL || createThread((thread_startfunc_t)func, arg, pfuture, NULL) != 0) {
+        if (pfuture != NULL) {
+            mFuture.erase(*future);
+            delete pfuture;
+        }
+        unmaskInterrupts();
+        return -1;
+    }
+    unmaskInterrupts();
+    return 0;
+}
+
+int thread_future_get(unsigned int future, void** value) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    auto iter = mFuture.find(future);
+    if (iter == mFuture.end() || iter->second->waiter != NULL) {
+        unmaskInterrupts();
+        return -1;  // got already, or another thread is getting it
+    }
+    Future* pfuture = iter->second;
+    if (pfuture->ready == false) {
+        if (pthreadCurrent->task != NULL) {
+            unmaskInterrupts();
+            return -1;
+        }
+        pfuture->waiter = pthreadCurrent;
+        TRACE(pthreadCurrent, TRACE_BLOCK_SYNC, future);
+        PROFILE_BLOCK("future", future);
+        swapcontext(pthreadCurrent->pucontext, pscheduler);  // until setFuture()
+    }
+    if (value != NULL) {
+        *value = pfuture->value;
+    }
+    mFuture.erase(future);
+    delete pfuture;
+    unmaskInterrupts();
+    return 0;
+}
+
+///////////////
+// worker pools
+///////////////
+
+// Run the jobs of a pool, parking between them, until the pool is destroyed.
+static void poolWorker(Pool* pool) {
+    maskInterrupts();
+    while (true) {
+        if (pool->qJobs.empty() == false) {
+            Job job = pool->qJobs.front();
+            pool->qJobs.pop_front();
+            unmaskInterrupts();
+            job.func(job.arg);
+            maskInterrupts();
+            pool->pending--;
+            while (pool->pending == 0 && pool->qWaiting.empty() == false) {
+                makeReady(pool->qWaiting.front());
+                pool->qWaiting.pop_front();
+            }
+        } else if (pool->stopping) {
+            break;
+        } else {
+            block(&pool->qIdle, "pool", pool->id);  // until thread_pool_submit() or thread_pool_destroy()
+        }
+    }
+    unmaskInterrupts();
+}
+
+// Is the current thread one of the pool's workers? They would wait for themselves.
+static bool isWorker(Pool* pool) {
+    for (unsigned int worker : pool->workers) {
+        if (worker == pthreadCurrent->id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int thread_pool_create(unsigned int pool, unsigned int workers) {
+    if (init == false || workers == 0) {
+        return -1;
+    }
+
+    maskInterrupts();
+    if (mPool.find(pool) != mPool.end()) {
+        unmaskInterrupts();
+        return -1;  // exists already
+    }
+    Pool* ppool = NULL;
+    try {
+        ppool = new Pool;
+        ppool->id = pool;
+        ppool->pending = 0;
+        ppool->stopping = false;
+        ppool->workers.reserve(workers);
+        mPool.insert(std::make_pair(pool, ppool));
+    } catch (std::bad_alloc err) {
+        delete ppool;
+        unmaskInterrupts();
+        return -1;
+    }
+    for (unsigned int i = 0; i < workers; i++) {
+        unsigned int id;
+        if (createThread((thread_startfunc_t)poolWorker, ppool, NULL, &id) != 0) {
+            break;  // keep the workers made so far
+        }
+        ppool->workers.push_back(id);
+    }
+    if (ppool->workers.empty()) {
+        mPool.erase(pool);
+        delete ppool;
+        unmaskInterrupts();
+        return -1;
+    }
+    unmaskInterrupts();
+    return 0;
+}
+
+int thread_pool_submit(unsigned int pool, thread_startfunc_t func, void* arg) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    auto iter = mPool.find(pool);
+    if (iter == mPool.end() || iter->second->stopping) {
+        unmaskInterrupts();
+        return -1;
+    }
+    Pool* ppool = iter->second;
+    try {
+        ppool->qJobs.push_back(Job{func, arg});
+    } catch (std::bad_alloc err) {
+        unmaskInterrupts();
+        return -1;
+    }
+    ppool->pending++;
+    if (ppool->qIdle.empty() == false) {
+        makeReady(ppool->qIdle.front());
+        ppool->qIdle.pop_front();
+    }
+    unmaskInterrupts();
+    return 0;
+}
+
+int thread_pool_wait(unsigned int pool) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    auto iter = mPool.find(pool);
+    int result = 0;
+    if (iter == mPool.end() || isWorker(iter->second)) {
+        result = -1;
+    } else if (iter->second->pending > 0) {
+        result = block(&iter->second->qWaiting, "pool", pool);  // woken by the worker finishing the last job
+    }
+    unmaskInterrupts();
+    return result;
+}
+
+int thread_pool_destroy(unsigned int pool) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    auto iter = mPool.find(pool);
+    if (iter == mPool.end() || iter->second->stopping || isWorker(iter->second)) {
+        unmaskInterrupts();
+        return -1;
+    }
+    Pool* ppool = iter->second;
+    ppool->stopping = true;  // the workers finish the jobs queued, then exit
+    while (ppool->qIdle.empty() == false) {
+        makeReady(ppool->qIdle.front());
+        ppool->qIdle.pop_front();
+    }
+    unmaskInterrupts();
+
+    int result = 0;
+    for (unsigned int worker : ppool->workers) {
+        if (thread_join(worker) != 0) {
+            result = -1;
+        }
+    }
+
+    maskInterrupts();
+    mPool.erase(pool);
+    delete ppool;
+    unmaskInterrupts();
+    return result;
+}
+
+/////////////////////
+// per-thread storage
+/////////////////////
+
+int thread_key_create(unsigned int* key, thread_destructor_t destructor) {
+    if (init == false || key == NULL) {
+        return -1;
+    }
+
+    maskInterrupts();
+    if (keyCount == THREAD_KEYS_MAX) {
+        unmaskInterrupts();
+        return -1;
+    }
+    keyDestructors[keyCount] = destructor;
+    *key = keyCount;
+    keyCount++;
+    unmaskInterrupts();
+    return 0;
+}
+
+// Neither needs interrupts disabled: if the thread is preempted in between, pthreadCurrent is its own TCB
+// again when it runs on.
+void* thread_getspecific(unsigned int key) {
+    if (init == false || key >= keyCount) {
+        return NULL;
+    }
+    return pthreadCurrent->specific[key];
+}
+
+int thread_setspecific(unsigned int key, const void* value) {
+    if (init == false || key >= keyCount) {
+        return -1;
+    }
+    pthreadCurrent->specific[key] = (void*)value;
+    return 0;
+}
+
+int thread_set_wake_affinity(bool on) {
+    if (init == false) {
+        return -1;
+    }
+
+    maskInterrupts();
+    wakeAffinity = on;
+    unmaskInterrupts();
+    return 0;
+}
+
+int thread_set_quantum(unsigned int usec) {
+    if (init == false) {
+        return -1;
+    }
+
+    if (hasQuantumTimer == false) {
+        struct sigaction action;
+        action.sa_handler = quantumExpired;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        struct sigevent event;
+        event.sigev_notify = SIGEV_SIGNAL;
+        event.sigev_signo = SIGVTALRM;
+        event.sigev_value.sival_ptr = NULL;
+        // CPU time of this process thread: only time spent running user threads uses up a quantum
+        if (sigaction(SIGVTALRM, &action, NULL) != 0 ||
+            timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &quantumTimer) != 0) {
+            return -1;
+        }
+        hasQuantumTimer = true;
+    }
+    struct itimerspec spec;
+    spec.it_value.tv_sec = usec / 1000000;
+    spec.it_value.tv_nsec = (usec % 1000000) * 1000;
+    spec.it_interval = spec.it_value;  // all zero stops the timer
+    return timer_settime(quantumTimer, 0, &spec, NULL) == 0 ? 0 : -1;
+}
+
+int thread_getstats(thread_stats_t* stats) {
+    if (init == false || stats == NULL) {
+        return -1;
+    }
+
+    maskInterrupts();
+    *stats = libStats;
+    unmaskInterrupts();
+
+    return 0;
+}
+
+////////
+// tasks
+////////
+
+#ifdef __cpp_impl_coroutine
+int thread_create_task(thread_task task) {
+    if (init == false || !task.handle) {
+        return -1;
+    }
+
+    Thread* pthread = NULL;
+
+    maskInterrupts();
+
+    try {
+        // no context or stack: the task runs on the scheduler's stack, and keeps its state in its frame
+        pthread = new Thread;
+        pthread->pucontext = NULL;
+        pthread->stack = NULL;
+        pthread->id = tid;
+        tid++;
+        pthread->isFinished = false;
+        pthread->task = task.handle.address();
+        pthread->hasPendingLock = false;
+        pthread->qJoiners = NULL;
+        pthread->future = NULL;
+        std::fill(pthread->specific, pthread->specific + THREAD_KEYS_MAX, (void*)NULL);
+        mThread.insert(std::make_pair(pthread->id, pthread));
+#ifdef THREAD_TRACE
+        traceStart(pthread);
+        TRACE(pthread, TRACE_CREATE, pthreadCurrent != NULL ? pthreadCurrent->id : pthread->id);
+#endif
+#ifdef THREAD_PROFILE
+        profileStart(pthread);
+#endif
+        qReady.push_back(pthread);
+    } catch (std::bad_alloc err) {
+        delete pthread;
+        task.handle.destroy();
+
+        unmaskInterrupts();
+        return -1;
+    }
+
+    unmaskInterrupts();
+    return 0;
+}
+
+void thread_task_final::await_suspend(std::coroutine_handle<>) noexcept {
+    // left suspended at its end, the frame is destroyed by deleteCurrentThread()
+    destroySpecific();
+    maskInterrupts();
+    finishCurrentThread();
+}
+
+void thread_co_yield::await_suspend(std::coroutine_handle<>) {
+    maskInterrupts();
+    TRACE(pthreadCurrent, TRACE_YIELD, 0);
+    qReady.push_back(pthreadCurrent);
+}
+
+bool thread_co_lock::await_ready() {
+    // tasks are not preempted, so the lock cannot be taken between this check and thread_lock()
+    maskInterrupts();
+    auto iter = mLock.find(lock);
+    bool ready = iter == mLock.end() || iter->second->owner == NULL || iter->second->owner == pthreadCurrent;
+    unmaskInterrupts();
+    if (ready) {
+        result = thread_lock(lock);  // -1 if the task already holds it, as for a thread
+    }
+    return ready;
+}
+
+void thread_co_lock::await_suspend(std::coroutine_handle<>) {
+    maskInterrupts();
+    TRACE(pthreadCurrent, TRACE_BLOCK_LOCK, lock);
+    PROFILE_CONTENDED(mLock[lock], lock);
+    mLock[lock]->qBlocked->push_back(pthreadCurrent);
+    pthreadCurrent->hasPendingLock = true;  // thread_unlock() hands it over, takePendingLock() counts it
+    pthreadCurrent->pendingLock = lock;
+}
+
+bool thread_co_wait::await_suspend(std::coroutine_handle<>) {
+    maskInterrupts();
+
+    if (thread_unlock_with_interrupt_disabled(lock) != 0) {
+        result = -1;
+        unmaskInterrupts();
+        return false;  // resume at once
+    }
+    auto iter = mCV.find(cond);
+    if (iter == mCV.end()) {
+        try {
+            iter = mCV.insert(std::make_pair(cond, new deque<Thread*>)).first;
+        } catch (std::bad_alloc err) {
+            result = -1;
+            iter = mCV.end();
+        }
+    }
+    if (iter != mCV.end()) {
+        iter->second->push_back(pthreadCurrent);
+        TRACE(pthreadCurrent, TRACE_WAIT_CV, cond);
+        PROFILE_BLOCK("cv", cond);
+    } else {
+        qReady.push_back(pthreadCurrent);  // failed, but the lock has to be taken back first
+    }
+    pthreadCurrent->hasPendingLock = true;  // reacquired by takePendingLock() once signaled
+    pthreadCurrent->pendingLock = lock;
+    return true;
+}
+#endif
\ No newline at end of file
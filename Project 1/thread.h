@@ -20,6 +20,84 @@ extern int thread_wait(unsigned int lock, unsigned int cond);
 extern int thread_signal(unsigned int lock, unsigned int cond);
 extern int thread_broadcast(unsigned int lock, unsigned int cond);
 
+/*
+ * Reader-writer locks, counting semaphores and barriers, each with its own
+ * unsigned int ID space.  A thread that blocks on one is given what it waited
+ * for before it is made ready, so it never has to check again after waking.
+ *
+ * A reader-writer lock is created by its first use, preferring writers.
+ * thread_rwlock_init() may be called first to choose: with prefer_writers, a
+ * waiting writer keeps new readers out, otherwise readers are only kept out by
+ * a writer holding the lock.  thread_rwlock_unlock() releases a write lock
+ * held by the caller, or else one of the read locks.
+ *
+ * Semaphores and barriers must be created with thread_sem_init() and
+ * thread_barrier_init().  thread_barrier_wait() returns 1 in the thread that
+ * completes the barrier, 0 in the others, and the barrier is then reusable.
+ */
+extern int thread_rwlock_init(unsigned int rwlock, bool prefer_writers);
+extern int thread_rwlock_rdlock(unsigned int rwlock);
+extern int thread_rwlock_wrlock(unsigned int rwlock);
+extern int thread_rwlock_unlock(unsigned int rwlock);
+extern int thread_sem_init(unsigned int sem, unsigned int value);
+extern int thread_sem_wait(unsigned int sem);
+extern int thread_sem_post(unsigned int sem);
+extern int thread_barrier_init(unsigned int barrier, unsigned int count);
+extern int thread_barrier_wait(unsigned int barrier);
+
+/*
+ * thread_create_id() is thread_create() that also returns the new thread's
+ * ID, the one thread_self() returns in it.  thread_join() waits until that
+ * thread or task has finished; it returns at once if it already has.
+ *
+ * A future is an unsigned int naming a value that is set once.
+ * thread_promise() makes one for thread_promise_set(), and thread_async()
+ * makes one that is set to what func returns when its new thread finishes.
+ * thread_future_get() waits for the value and then frees the future, so
+ * it is called exactly once per future, by one thread.
+ */
+typedef void *(*thread_resultfunc_t) (void *);
+
+extern int thread_self(void);
+extern int thread_create_id(thread_startfunc_t func, void *arg, unsigned int *id);
+extern int thread_join(unsigned int thread);
+extern int thread_promise(unsigned int *future);
+extern int thread_promise_set(unsigned int future, void *value);
+extern int thread_async(thread_resultfunc_t func, void *arg, unsigned int *future);
+extern int thread_future_get(unsigned int future, void **value);
+
+/*
+ * thread_create_n() creates count threads running func, the i-th one with
+ * args[i] as its argument, or with i if args is NULL.  Finished threads keep
+ * their stack and context for the next thread created, up to a limit.
+ *
+ * A worker pool runs submitted functions on parked worker threads instead
+ * of creating a thread for each.  thread_pool_create() starts the workers
+ * (returning 0 with at least one of them), thread_pool_wait() waits until
+ * every function submitted so far has returned, and thread_pool_destroy()
+ * lets the workers finish what was submitted, then ends them.  A worker's
+ * functions must not wait for or destroy its own pool.
+ */
+extern int thread_create_n(thread_startfunc_t func, void **args, unsigned int count);
+extern int thread_pool_create(unsigned int pool, unsigned int workers);
+extern int thread_pool_submit(unsigned int pool, thread_startfunc_t func, void *arg);
+extern int thread_pool_wait(unsigned int pool);
+extern int thread_pool_destroy(unsigned int pool);
+
+/*
+ * thread_getstats() copies the counters kept by the thread library since
+ * thread_libinit() into *stats.  They can be used to compare how much
+ * scheduling work different synchronization strategies cause.
+ */
+struct thread_stats_t {
+    unsigned long switches;     /* context switches into user threads */
+    unsigned long locks;        /* successful thread_lock() calls, including the re-lock in thread_wait() */
+    unsigned long wakeups;      /* threads made ready by thread_unlock/signal/broadcast */
+    unsigned long preemptions;  /* quanta of thread_set_quantum() that ended in a switch */
+};
+
+extern int thread_getstats(thread_stats_t *stats);
+
 /*
  * start_preemptions() can be used in testing to configure the generation
  * of interrupts (which in turn lead to preemptions).
@@ -45,4 +123,51 @@ extern int thread_broadcast(unsigned int lock, unsigned int cond);
  */
 extern void start_preemptions(bool async, bool sync, int random_seed);
 
+/*
+ * thread_set_quantum() preempts the running thread after every usec
+ * microseconds of CPU time it uses, measured with a timer_create() timer on
+ * CLOCK_THREAD_CPUTIME_ID; 0 stops preemption.  A quantum that ends inside
+ * the thread library takes effect when the library call returns.  A short
+ * quantum (around 1000) bounds how long a ready thread waits, a long one
+ * (50000 and up) keeps switches, and their cache misses, rare.  The kernel
+ * checks CPU-time timers at its tick, so shorter quanta are rounded up to it.
+ * Tasks of thread_create_task() are never preempted.
+ *
+ * The switch happens inside the SIGVTALRM handler, which calls
+ * thread_yield() for the running thread.  Do not combine thread_set_quantum()
+ * with start_preemptions(): the interrupts of interrupt.cc would then run
+ * their own handler on a thread the quantum timer may switch away from.
+ *
+ * Build the library with -DTHREAD_FAST_MASK to keep its critical sections
+ * with a flag only, instead of also calling interrupt_disable() and
+ * interrupt_enable(); start_preemptions() cannot be used then.
+ */
+extern int thread_set_quantum(unsigned int usec);
+
+/*
+ * thread_set_wake_affinity(true) runs the thread most recently woken by an
+ * unlock, signal, broadcast, post or the like next, ahead of the ready queue,
+ * while its data is still warm in the cache.  A thread it displaces from that
+ * slot goes to the tail of the queue, and after 8 runs from the slot in a row
+ * the head of the queue runs first.  It is off by default: woken threads
+ * queue behind every ready thread in FIFO order.
+ */
+extern int thread_set_wake_affinity(bool on);
+
+/*
+ * Per-thread storage.  thread_key_create() returns in *key a new key, up to
+ * THREAD_KEYS_MAX of them for the life of the program.  Each thread and task
+ * has its own value for every key, NULL until it calls thread_setspecific();
+ * the values live in its TCB, so thread_getspecific() is an array read.
+ * When a thread finishes, the destructor of each key, if any, is called
+ * with its value if that is not NULL.
+ */
+#define THREAD_KEYS_MAX 16
+
+typedef void (*thread_destructor_t) (void *);
+
+extern int thread_key_create(unsigned int *key, thread_destructor_t destructor);
+extern void *thread_getspecific(unsigned int key);
+extern int thread_setspecific(unsigned int key, const void *value);
+
 #endif /* _THREAD_H */
@@ -0,0 +1,79 @@
+/*
+ * thread_task.h -- stackless tasks for the thread library (C++20)
+ *
+ * A task is a C++20 coroutine returning thread_task.  thread_create_task()
+ * puts it on the same ready queue as the threads made by thread_create(), but
+ * it has no stack or ucontext of its own: it runs on the scheduler's stack
+ * until it suspends, and costs its coroutine frame plus a TCB, a few hundred
+ * bytes, instead of STACK_SIZE.
+ *
+ * A task blocks only at co_await:
+ *
+ *     co_await thread_co_yield();
+ *     co_await thread_co_lock(lock);        returns 0, or -1 like thread_lock()
+ *     co_await thread_co_wait(lock, cond);  returns 0, or -1 like thread_wait()
+ *
+ * The lock and CV IDs are the same as those of thread_lock() and thread_wait(),
+ * so tasks and threads can share locks and CVs.  thread_unlock(),
+ * thread_signal() and thread_broadcast() never block and are called directly.
+ * Calling thread_yield() in a task does nothing, and a thread_lock() or
+ * thread_wait() that would have to block returns -1.  Tasks are never
+ * preempted.
+ */
+#ifndef _THREAD_TASK_H
+#define _THREAD_TASK_H
+
+#include <coroutine>
+#include <exception>
+#include "thread.h"
+
+struct thread_task_final {
+    bool await_ready() noexcept { return false; }
+    void await_suspend(std::coroutine_handle<>) noexcept;
+    void await_resume() noexcept {}
+};
+
+struct thread_task {
+    struct promise_type {
+        thread_task get_return_object() {
+            return thread_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        thread_task_final final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+extern int thread_create_task(thread_task task);
+
+struct thread_co_yield {
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<>);
+    void await_resume() {}
+};
+
+struct thread_co_lock {
+    unsigned int lock;
+    int result;
+
+    thread_co_lock(unsigned int lock) : lock(lock), result(0) {}
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<>);
+    int await_resume() { return result; }
+};
+
+struct thread_co_wait {
+    unsigned int lock;
+    unsigned int cond;
+    int result;
+
+    thread_co_wait(unsigned int lock, unsigned int cond) : lock(lock), cond(cond), result(0) {}
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<>);
+    int await_resume() { return result; }
+};
+
+#endif /* _THREAD_TASK_H */
@@ -3,7 +3,9 @@
 
 #include <iostream>
 
+#ifndef NO_DEBUGGING
 #define DEBUGGING
+#endif
 
 #ifdef DEBUGGING
 #define DEBUG(x) std::cerr << ">>>>> " << #x << ": " << x << std::endl
@@ -19,9 +21,9 @@ extern int ADDR_PAGE_OFFSET_BIT;
 extern int MAX_FRAMES;
 extern int MAX_PAGES;
 
-#define ASSUMED_MAX_PAGES  2 << 5
-#define ASSUMED_MAX_FRAMES  2 << 5
-
 typedef unsigned long Address8;
 
+// Top bit of an address in a trace: set for a write, clear for a read. Traces without writes are unchanged.
+#define ADDR_WRITE_BIT (1UL << 63)
+
 #endif
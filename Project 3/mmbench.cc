@@ -0,0 +1,130 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+#include "mm2types.h"
+#include "pagetable.h"
+
+/**
+ * Translation throughput on large configurations: every page is resident, so the run measures how
+ * well the page table and frame table stay in cache. The hit path is replayed inline on the same access
+ * stream with the former layout (16-byte PTE, frame table as an array of {page, counter}) and with the
+ * packed one (8-byte PTE, counters in their own array), then through PageTable::map itself.
+ *
+ * usage: mmbench [pages] [accesses]
+ * Build with -DNO_DEBUGGING, the DEBUG output of PageTable::map would dominate otherwise.
+ */
+
+int ADDR_LENGTH = 8;
+int ADDR_PAGE_OFFSET_BIT = 12;
+int MAX_FRAMES = 8;
+int MAX_PAGES = 32;
+
+// the layout before PTE was packed
+struct PaddedPTE {
+    Address8 frame;
+    bool valid;
+};
+
+struct PaddedFrame {
+    Address8 page;
+    int counter;
+};
+
+// xorshift: cheap enough not to hide the memory accesses being measured
+static inline Address8 nextRandom(Address8& state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    long pages = argc > 1 ? std::atol(argv[1]) : 1L << 22;
+    long accesses = argc > 2 ? std::atol(argv[2]) : 1L << 25;
+    if (pages < 2 || accesses < 1) {
+        ERROR_RETURN;
+    }
+    MAX_PAGES = pages;
+    MAX_FRAMES = pages + 1;  // frame 0 is for kernel
+    int pageShift = ADDR_PAGE_OFFSET_BIT;
+
+    // former layout
+    PaddedPTE* paddedPT = new PaddedPTE[MAX_PAGES];
+    PaddedFrame* paddedFT = new PaddedFrame[MAX_FRAMES];
+    for (long page = 0; page < pages; page++) {
+        paddedPT[page].frame = page + 1;
+        paddedPT[page].valid = true;
+        paddedFT[page + 1].page = page;
+        paddedFT[page + 1].counter = 0;
+    }
+    Address8 state = 88172645463325252UL, checksum = 0;
+    int timer = 1;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < accesses; i++) {
+        Address8 addrVirtual = nextRandom(state) % (pages << pageShift);
+        Address8 page = addrVirtual >> pageShift;
+        Address8 offset = page << pageShift ^ addrVirtual;
+        if (paddedPT[page].valid) {
+            paddedFT[paddedPT[page].frame].counter = timer++;
+        }
+        checksum += paddedPT[page].frame << pageShift | offset;
+    }
+    double paddedSeconds = secondsSince(start);
+    delete[] paddedPT;
+    delete[] paddedFT;
+
+    // packed layout
+    PTE* packedPT = new PTE[MAX_PAGES];
+    long* packedCounter = new long[MAX_FRAMES];
+    for (long page = 0; page < pages; page++) {
+        packedPT[page].frame = page + 1;
+        packedPT[page].valid = true;
+        packedCounter[page + 1] = 0;
+    }
+    state = 88172645463325252UL;
+    long packedTimer = 1;
+    start = std::chrono::steady_clock::now();
+    for (long i = 0; i < accesses; i++) {
+        Address8 addrVirtual = nextRandom(state) % (pages << pageShift);
+        Address8 page = addrVirtual >> pageShift;
+        Address8 offset = page << pageShift ^ addrVirtual;
+        if (packedPT[page].valid) {
+            packedCounter[packedPT[page].frame] = packedTimer++;
+        }
+        checksum += (Address8)packedPT[page].frame << pageShift | offset;
+    }
+    double packedSeconds = secondsSince(start);
+    delete[] packedPT;
+    delete[] packedCounter;
+
+    // the real thing
+    PageTable* pt = new PageTable();
+    PhyFrames* ft = new PhyFrames();
+    pt->alignPhyFrames(ft);
+    ft->alignPageTable(pt);
+    for (long page = 0; page < pages; page++) {
+        pt->map(page);  // fill every frame
+    }
+    state = 88172645463325252UL;
+    start = std::chrono::steady_clock::now();
+    for (long i = 0; i < accesses; i++) {
+        Address8 addrVirtual = nextRandom(state) % (pages << pageShift);
+        Address8 page = addrVirtual >> pageShift;
+        Address8 offset = page << pageShift ^ addrVirtual;
+        checksum += pt->map(page) << pageShift | offset;
+    }
+    double mapSeconds = secondsSince(start);
+
+    std::cout << "pages " << pages << " accesses " << accesses << std::endl;
+    std::cout << "padded PTE " << sizeof(PaddedPTE) << " bytes, " << (long)(accesses / paddedSeconds) << " translations/s" << std::endl;
+    std::cout << "packed PTE " << sizeof(PTE) << " bytes, " << (long)(accesses / packedSeconds) << " translations/s" << std::endl;
+    std::cout << "PageTable::map " << (long)(accesses / mapSeconds) << " translations/s" << std::endl;
+    std::cerr << "checksum " << checksum << std::endl;  // keeps both loops from being optimized away
+
+    return 0;
+}
\ No newline at end of file
@@ -4,22 +4,16 @@
 
 #include "mm2types.h"
 #include "pagetable.h"
+#include "translate.h"
 
 #define OUTFILE_FILENAME "output-part2"
 
 int ADDR_LENGTH = 8;
-int ADDR_PAGE_OFFSET_BIT = 7;
+const int PAGE_SHIFT = 7;  // ADDR_PAGE_OFFSET_BIT as a compile-time constant
+int ADDR_PAGE_OFFSET_BIT = PAGE_SHIFT;
 int MAX_FRAMES = 8;
 int MAX_PAGES = 32;
 
-Address8 translateAddress(Address8 addrVirtual, int pageShift, PageTable* pt) {
-    Address8 page = addrVirtual >> pageShift;
-    Address8 offset = page << pageShift ^ addrVirtual;
-    Address8 frame = pt->map(page);
-    Address8 addrPhysical = frame << pageShift | offset;
-    return addrPhysical;
-}
-
 int main(int argc, char** argv) {
     if (argc != 2) {
         ERROR_RETURN;
@@ -46,7 +40,7 @@ int main(int argc, char** argv) {
         if (filein.eof())
             break;
         DEBUG16(addrVirtual);
-        Address8 addrPhysical = translateAddress(addrVirtual, ADDR_PAGE_OFFSET_BIT, pt);
+        Address8 addrPhysical = translateAddress<PAGE_SHIFT, Address8>(addrVirtual, pt);
         DEBUG16(addrPhysical);
         fileout.write((char*)&addrPhysical, ADDR_LENGTH);
     }
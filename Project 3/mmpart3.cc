@@ -1,52 +1,365 @@
+#include <algorithm>
+#include <cstdio>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "mm2types.h"
+#include "mrcsampler.h"
 #include "pagetable.h"
+#include "snapshot.h"
+#include "swapdevice.h"
+#include "tracecodec.h"
+#include "tracereader.h"
+#include "translate.h"
 
 #define OUTFILE_FILENAME "output-part3"
+#define OUTPUT_BUFFER 4096  // physical addresses written at once
 
 int ADDR_LENGTH = 8;
 int ADDR_PAGE_OFFSET_BIT = 7;
 int MAX_FRAMES = 8;
 int MAX_PAGES = 32;
 
-int fastLog(int x) {
+/**
+ * log2 of x, or -1 if x is not a power of two (a page size that would otherwise be truncated silently).
+ */
+int fastLog(long x) {
+    if (x <= 0 || (x & (x - 1)) != 0) {
+        return -1;
+    }
     int counter = 0;
     for (; x >> 1 != 0; x >>= 1, counter++)
         ;
     return counter;
 }
 
-Address8 translateAddress(Address8 addrVirtual, int pageShift, PageTable* pt) {
-    Address8 page = addrVirtual >> pageShift;
-    Address8 offset = page << pageShift ^ addrVirtual;
-    Address8 frame = pt->map(page);
-    Address8 addrPhysical = frame << pageShift | offset;
-    return addrPhysical;
+/**
+ * Translate addresses start .. stop - 1 of the trace into fileout, a batch at a time. The batch comes straight from the mapped raw
+ * trace, or from decoder for a compressed one (8-byte addresses only). Instantiated for each page size and
+ * address width, so the inner loop only has constants in it; see replayDispatch(). Return -1 if the
+ * compressed trace turns out to be corrupt.
+ */
+template <int PAGE_SHIFT, typename ADDRESS>
+int replay(TraceReader& trace, TraceDecoder* decoder, long start, long stop, PageTable* pt, PhyFrames* ft,
+           const std::vector<long>& nextUse, std::ofstream& fileout) {
+    ADDRESS buffer[OUTPUT_BUFFER];
+    Address8 decoded[OUTPUT_BUFFER];
+    for (long first = start; first < stop; first += OUTPUT_BUFFER) {
+        long count = std::min<long>(OUTPUT_BUFFER, stop - first);
+        const ADDRESS* records = (const ADDRESS*)trace.data() + first;
+        if constexpr (sizeof(ADDRESS) == sizeof(Address8)) {
+            if (decoder) {
+                count = decoder->read(decoded, count);
+                if (count < 0) {
+                    return -1;
+                }
+                records = decoded;
+            }
+        }
+        for (long j = 0; j < count; j++) {
+            ADDRESS addrVirtual = records[j];
+            DEBUG16(addrVirtual);
+            if (!nextUse.empty()) {
+                ft->setNextUse(nextUse[first + j]);
+            }
+            ADDRESS addrPhysical = translateAddress<PAGE_SHIFT, ADDRESS>(addrVirtual, pt);
+            DEBUG16(addrPhysical);
+            buffer[j] = addrPhysical;
+        }
+        fileout.write((char*)buffer, count * sizeof(ADDRESS));
+    }
+    return 0;
 }
 
+/**
+ * Pick the instantiation of replay() for the page size once, before the loop.
+ */
+template <typename ADDRESS>
+int replayDispatch(TraceReader& trace, TraceDecoder* decoder, long start, long stop, PageTable* pt, PhyFrames* ft,
+                   const std::vector<long>& nextUse, std::ofstream& fileout) {
+    switch (ADDR_PAGE_OFFSET_BIT) {
+        case 7:  // 128 B, the size of the assignment
+            return replay<7, ADDRESS>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+        case 8:
+            return replay<8, ADDRESS>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+        case 9:
+            return replay<9, ADDRESS>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+        case 10:
+            return replay<10, ADDRESS>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+        case 12:  // 4 KiB
+            return replay<12, ADDRESS>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+        case 13:
+            return replay<13, ADDRESS>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+        case 14:
+            return replay<14, ADDRESS>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+        case 16:  // 64 KiB
+            return replay<16, ADDRESS>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+        case 21:  // 2 MiB
+            return replay<21, ADDRESS>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+        default:
+            return replay<-1, ADDRESS>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+    }
+}
+
+/**
+ * Reverse pre-pass for OPT: nextUse[i] is the index of the next access to the page of access i,
+ * NEVER_USED_AGAIN if there is none. Return -1 if an address is outside the virtual memory.
+ */
+template <typename ACCESS>
+int buildNextUseIndex(long length, ACCESS at, int pageShift, std::vector<long>& nextUse) {
+    nextUse.resize(length);
+    std::vector<long> lastSeen(MAX_PAGES, NEVER_USED_AGAIN);
+    Address8 writeBit = 1UL << (ADDR_LENGTH * 8 - 1);
+    for (long i = length - 1; i >= 0; i--) {
+        Address8 page = (at(i) & ~writeBit) >> pageShift;
+        if (page >= (Address8)MAX_PAGES) {
+            return -1;
+        }
+        nextUse[i] = lastSeen[page];
+        lastSeen[page] = i;
+    }
+    return 0;
+}
+
+/**
+ * After a resume under OPT, give every resident frame the index of the next access to its page from start
+ * on, NEVER_USED_AGAIN if there is none. A snapshot taken under another policy has no next uses, and
+ * without them pages that are never used again would not be the first victims.
+ */
+template <typename ACCESS>
+void seedNextUse(PhyFrames* ft, long start, long length, ACCESS at, int pageShift) {
+    std::unordered_map<Address8, int> waiting;  // resident page -> its frame
+    for (int frame = 1; frame < ft->framesHandedOut(); frame++) {
+        if (ft->lastAccess(frame) != NEVER_USED_AGAIN) {
+            waiting[ft->reverse(frame)] = frame;
+            ft->setFrameNextUse(frame, NEVER_USED_AGAIN);
+        }
+    }
+    Address8 writeBit = 1UL << (ADDR_LENGTH * 8 - 1);
+    for (long i = start; i < length && !waiting.empty(); i++) {
+        auto found = waiting.find((at(i) & ~writeBit) >> pageShift);
+        if (found != waiting.end()) {
+            ft->setFrameNextUse(found->second, i);
+            waiting.erase(found);
+        }
+    }
+}
+
+/**
+ * Estimate the LRU miss ratio curve of the trace instead of translating it, for 1, 2, 4, ... frames up to
+ * the whole virtual memory, and the frames of pmsize; sizes under 1 / rate frames are left out.
+ * Return -1 if the compressed trace turns out to be corrupt.
+ */
+int estimateMissRatioCurve(TraceReader& trace, TraceDecoder* decoder, double rate, long sampleCap) {
+    std::vector<long> sizes;
+    for (long frames = 1; frames < MAX_PAGES; frames *= 2) {
+        sizes.push_back(frames);
+    }
+    sizes.push_back(MAX_PAGES);
+    sizes.push_back(MAX_FRAMES);
+    std::sort(sizes.begin(), sizes.end());
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+
+    MrcSampler sampler(rate, sampleCap, sizes);
+    Address8 writeBit = 1UL << (ADDR_LENGTH * 8 - 1);
+    if (decoder) {
+        Address8 batch[OUTPUT_BUFFER];
+        long n;
+        while ((n = decoder->read(batch, OUTPUT_BUFFER)) > 0) {
+            for (long i = 0; i < n; i++) {
+                sampler.access((batch[i] & ~writeBit) >> ADDR_PAGE_OFFSET_BIT);
+            }
+        }
+        if (n < 0) {
+            return -1;
+        }
+    } else {
+        for (long i = 0; i < trace.length(); i++) {
+            sampler.access((trace.at(i) & ~writeBit) >> ADDR_PAGE_OFFSET_BIT);
+        }
+    }
+
+    std::cout << "mrc rate " << sampler.rate() << " pages sampled " << sampler.pagesSampled() << " references "
+              << sampler.references() << std::endl;
+    std::cout << std::fixed << std::setprecision(4);
+    for (int k = 0; k < (int)sizes.size(); k++) {
+        if (sizes[k] * sampler.rate() < 1) {
+            continue;  // one sampled page stands for 1 / rate pages: smaller distances are not seen
+        }
+        std::cout << "frames " << sizes[k] << " miss ratio " << sampler.missRatio(k) << " +- " << sampler.errorBound(k)
+                  << std::endl;
+    }
+    return 0;
+}
+
+/**
+ * usage: mmpart3 pagesize vmsize pmsize tracefile [option...]
+ * options:
+ *   lru | opt | cflru[=W]
+ *                  replacement policy, lru by default. cflru evicts the oldest clean page among the W least
+ *                  recently used ones (a quarter of the frames by default).
+ *   prefetch[=K]   adaptive readahead of at most K pages per stream (lru only), K = 8 by default
+ *   width=4|8      bytes per address in the trace and in the output, 8 by default
+ *   swap[=R,W,D]   simulate a swap device: a page-in costs R, a write-back W, and up to D write-backs are
+ *                  queued in the background. One memory access costs 1. Default 100,100,8.
+ *   ws=TAU[,N]     working set frame allocation: a page not accessed in the last TAU accesses gives its frame
+ *                  back. pmsize only caps the resident set. Prints resident set size and fault rate every N
+ *                  accesses, 1000 by default.
+ *   pff=T[,N]      page fault frequency frame allocation: a fault less than T accesses after the previous
+ *                  one gets one more frame, otherwise the pages not accessed since then are dropped.
+ *   huge=SIZE      second page size of SIZE bytes: a region of SIZE whose pages are all resident is moved
+ *                  into an aligned block of frames and mapped as one huge page, split again when one of its
+ *                  pages is evicted. Prints promotions, software TLB hits and reach, and the memory taken by
+ *                  tables of small entries (a table per region of SIZE).
+ *   tlb=SIZE       the same statistics without ever promoting, to compare against
+ *   checkpoint=N,FILE
+ *                  stop after translating N addresses and save the simulation state in FILE
+ *   resume=FILE    start from the state saved in FILE, at the trace offset it was saved at. output-part3
+ *                  only has what is translated from there. The sizes and the ws, pff, huge and tlb options,
+ *                  with their values, must be the same as when it was saved, or the resume is refused;
+ *                  policy, prefetch and swap costs may differ.
+ *   mrc[=R[,S]]    do not translate: estimate the LRU miss ratio curve from the pages sampled at rate R,
+ *                  keeping at most S of them (lowering the rate as needed, 0 for no limit). Default
+ *                  0.01,8192. mrc=1,0 gives the exact curve.
+ * Addresses with their top bit set are writes. pagesize must be a power of two. tracefile is either raw
+ * addresses or compressed by traceconv (8-byte addresses), told apart by its header.
+ * With any option given, statistics are printed after the translation.
+ */
 int main(int argc, char** argv) {
-    if (argc != 5) {
+    if (argc < 5) {
         ERROR_RETURN;
     }
+    int policy = POLICY_LRU;
+    int prefetchWindow = 0;
+    int cleanWindow = 0;
+    bool simulateSwap = false;
+    double readCost = 100, writeCost = 100;
+    int queueDepth = 8;
+    double mrcRate = 0;
+    long mrcSampleCap = 8192;
+    int budgetMode = BUDGET_FIXED;
+    long budgetParameter = 0, seriesInterval = 1000;
+    long hugePageSize = 0;
+    bool promote = false;
+    long checkpointAfter = 0;
+    std::string checkpointFile, resumeFile;
+    for (int i = 5; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "opt") {
+            policy = POLICY_OPT;
+        } else if (option == "lru") {
+            policy = POLICY_LRU;
+        } else if (option == "cflru") {
+            policy = POLICY_CFLRU;
+        } else if (option.compare(0, 6, "cflru=") == 0) {
+            policy = POLICY_CFLRU;
+            cleanWindow = std::atoi(option.c_str() + 6);
+            if (cleanWindow < 1) {
+                ERROR_RETURN;
+            }
+        } else if (option == "width=4" || option == "width=8") {
+            ADDR_LENGTH = option[6] - '0';
+        } else if (option == "swap") {
+            simulateSwap = true;
+        } else if (option.compare(0, 5, "swap=") == 0) {
+            simulateSwap = true;
+            if (std::sscanf(option.c_str() + 5, "%lf,%lf,%d", &readCost, &writeCost, &queueDepth) != 3 ||
+                readCost < 0 || writeCost < 0 || queueDepth < 1) {
+                ERROR_RETURN;
+            }
+        } else if (option.compare(0, 3, "ws=") == 0 || option.compare(0, 4, "pff=") == 0) {
+            budgetMode = option[0] == 'w' ? BUDGET_WS : BUDGET_PFF;
+            int fields =
+                std::sscanf(option.c_str() + option.find('=') + 1, "%ld,%ld", &budgetParameter, &seriesInterval);
+            if (fields < 1 || budgetParameter < 1 || seriesInterval < 1) {
+                ERROR_RETURN;
+            }
+        } else if (option.compare(0, 5, "huge=") == 0 || option.compare(0, 4, "tlb=") == 0) {
+            promote = option[0] == 'h';
+            hugePageSize = std::atol(option.c_str() + option.find('=') + 1);
+            if (fastLog(hugePageSize) < 0) {
+                ERROR_RETURN;
+            }
+        } else if (option.compare(0, 11, "checkpoint=") == 0) {
+            size_t comma = option.find(',');
+            checkpointAfter = std::atol(option.c_str() + 11);
+            if (comma == std::string::npos || checkpointAfter < 1) {
+                ERROR_RETURN;
+            }
+            checkpointFile = option.substr(comma + 1);
+        } else if (option.compare(0, 7, "resume=") == 0) {
+            resumeFile = option.substr(7);
+        } else if (option == "mrc") {
+            mrcRate = 0.01;
+        } else if (option.compare(0, 4, "mrc=") == 0) {
+            int fields = std::sscanf(option.c_str() + 4, "%lf,%ld", &mrcRate, &mrcSampleCap);
+            if (fields < 1 || mrcRate <= 0 || mrcRate > 1 || mrcSampleCap < 0) {
+                ERROR_RETURN;
+            }
+        } else if (option == "prefetch") {
+            prefetchWindow = 8;
+        } else if (option.compare(0, 9, "prefetch=") == 0) {
+            prefetchWindow = std::atoi(option.c_str() + 9);
+            if (prefetchWindow < 1) {
+                ERROR_RETURN;
+            }
+        } else {
+            ERROR_RETURN;
+        }
+    }
+    if (policy == POLICY_OPT && prefetchWindow > 0) {
+        ERROR_RETURN;  // prefetched pages have no next use known to OPT
+    }
+    if (hugePageSize > 0 && policy == POLICY_OPT) {
+        ERROR_RETURN;  // moving pages between frames would make the OPT queue stale
+    }
+    if (budgetMode != BUDGET_FIXED && prefetchWindow > 0) {
+        ERROR_RETURN;  // prefetched pages are not accessed, so they would never leave the working set
+    }
 
-    int sizeOfPage = std::atoi(argv[1]);
+    long sizeOfPage = std::atol(argv[1]);
     ADDR_PAGE_OFFSET_BIT = fastLog(sizeOfPage);
     DEBUG(ADDR_PAGE_OFFSET_BIT);
-    int sizeOfVirtualMemory = std::atoi(argv[2]);
+    if (ADDR_PAGE_OFFSET_BIT < 0 || ADDR_PAGE_OFFSET_BIT >= ADDR_LENGTH * 8 - 1) {
+        std::cerr << "page size must be a power of two that fits the address width" << std::endl;
+        ERROR_RETURN;
+    }
+    long sizeOfVirtualMemory = std::atol(argv[2]);
     MAX_PAGES = sizeOfVirtualMemory / sizeOfPage;
-    int sizeOfPhysicalMemory = std::atoi(argv[3]);
+    long sizeOfPhysicalMemory = std::atol(argv[3]);
     MAX_FRAMES = sizeOfPhysicalMemory / sizeOfPage;
     std::string filename = argv[4];
-    std::ifstream filein;
+    TraceReader trace;
+    TraceDecoder compressed;
+    TraceDecoder* decoder = NULL;
     std::ofstream fileout;
 
-    filein.open(filename, std::ios::binary | std::ios::in);
-    fileout.open(OUTFILE_FILENAME, std::ios::binary | std::ios::out);
+    int opened = compressed.open(filename.c_str());
+    if (opened == 0) {
+        if (ADDR_LENGTH != sizeof(Address8)) {
+            ERROR_RETURN;
+        }
+        decoder = &compressed;
+    } else if (opened == -2) {
+        std::cerr << "corrupt trace " << filename << std::endl;
+        ERROR_RETURN;
+    } else if (trace.open(filename.c_str(), ADDR_LENGTH) != 0) {
+        ERROR_RETURN;
+    }
+    if (mrcRate > 0) {
+        if (estimateMissRatioCurve(trace, decoder, mrcRate, mrcSampleCap) != 0) {
+            std::cerr << "corrupt trace " << filename << std::endl;
+            ERROR_RETURN;
+        }
+        return 0;
+    }
 
-    if (!filein || !fileout) {
+    fileout.open(OUTFILE_FILENAME, std::ios::binary | std::ios::out);
+    if (!fileout) {
         ERROR_RETURN;
     }
 
@@ -54,18 +367,116 @@ int main(int argc, char** argv) {
     PhyFrames* ft = new PhyFrames();
     pt->alignPhyFrames(ft);
     ft->alignPageTable(pt);
-    while (true) {
-        Address8 addrVirtual;
-        filein.read((char*)&addrVirtual, ADDR_LENGTH);
-        if (filein.eof())
-            break;
-        DEBUG16(addrVirtual);
-        Address8 addrPhysical = translateAddress(addrVirtual, ADDR_PAGE_OFFSET_BIT, pt);
-        DEBUG16(addrPhysical);
-        fileout.write((char*)&addrPhysical, ADDR_LENGTH);
-    }
-    filein.close();
+    SwapDevice* swap = NULL;
+    if (simulateSwap) {
+        swap = new SwapDevice(readCost, writeCost, queueDepth);
+        pt->alignSwapDevice(swap);
+    }
+    if (hugePageSize > 0 && pt->enableHugePages(fastLog(hugePageSize) - ADDR_PAGE_OFFSET_BIT, promote) != 0) {
+        std::cerr << "huge page size must be a larger power of two, with at least two of them in pmsize" << std::endl;
+        ERROR_RETURN;
+    }
+    if (budgetMode == BUDGET_WS) {
+        pt->enableWorkingSet(budgetParameter, seriesInterval);
+    } else if (budgetMode == BUDGET_PFF) {
+        pt->enablePageFaultFrequency(budgetParameter, seriesInterval);
+    }
+    long start = 0;
+    long stop = decoder ? decoder->length() : trace.length();
+    if (!resumeFile.empty() && (Snapshot::restore(resumeFile.c_str(), pt, ft, swap, &start) != 0 || start > stop)) {
+        std::cerr << "cannot resume from " << resumeFile << std::endl;
+        ERROR_RETURN;
+    }
+    if (checkpointAfter > 0) {
+        stop = std::min(stop, start + checkpointAfter);
+    }
+    // set after a restore, so that a resumed run can try another configuration
+    ft->setPolicy(policy);
+    if (cleanWindow > 0) {
+        ft->setCleanWindow(cleanWindow);
+    }
+    pt->enablePrefetch(prefetchWindow);
+    std::vector<long> nextUse;
+    if (policy == POLICY_OPT) {
+        if (decoder) {
+            // OPT looks backwards, so a compressed trace is decoded whole for the pre-pass
+            std::vector<Address8> addresses(decoder->length());
+            if (decoder->read(addresses.data(), addresses.size()) != (long)addresses.size()) {
+                std::cerr << "corrupt trace " << filename << std::endl;
+                ERROR_RETURN;
+            }
+            auto at = [&](long i) { return addresses[i]; };
+            if (buildNextUseIndex(addresses.size(), at, ADDR_PAGE_OFFSET_BIT, nextUse) != 0) {
+                std::cerr << "corrupt trace " << filename << std::endl;
+                ERROR_RETURN;
+            }
+            if (!resumeFile.empty()) {
+                seedNextUse(ft, start, addresses.size(), at, ADDR_PAGE_OFFSET_BIT);
+            }
+        } else {
+            auto at = [&](long i) { return trace.at(i); };
+            if (buildNextUseIndex(trace.length(), at, ADDR_PAGE_OFFSET_BIT, nextUse) != 0) {
+                std::cerr << "corrupt trace " << filename << std::endl;
+                ERROR_RETURN;
+            }
+            if (!resumeFile.empty()) {
+                seedNextUse(ft, start, trace.length(), at, ADDR_PAGE_OFFSET_BIT);
+            }
+        }
+    }
+    int replayed;
+    if (decoder && decoder->seek(start) != 0) {
+        replayed = -1;
+    } else if (ADDR_LENGTH == sizeof(Address4)) {
+        replayed = replayDispatch<Address4>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+    } else {
+        replayed = replayDispatch<Address8>(trace, decoder, start, stop, pt, ft, nextUse, fileout);
+    }
+    if (replayed != 0) {
+        std::cerr << "corrupt trace " << filename << std::endl;
+        ERROR_RETURN;
+    }
+    if (!checkpointFile.empty() && Snapshot::save(checkpointFile.c_str(), pt, ft, swap, stop) != 0) {
+        ERROR_RETURN;
+    }
     fileout.close();
 
+    if (argc > 5) {
+        std::cout << "faults " << pt->faults() << std::endl;
+        if (prefetchWindow > 0) {
+            std::cout << "prefetch issued " << pt->prefetchIssued() << " useful " << pt->prefetchUseful() << " wasted "
+                      << pt->prefetchWasted() << std::endl;
+        }
+        if (hugePageSize > 0) {
+            std::cout << "huge promotions " << pt->promotions() << " demotions " << pt->demotions() << std::endl;
+            std::cout << "tlb hits " << pt->tlbHits() << " misses " << pt->tlbMisses() << " reach " << pt->tlbReach()
+                      << " bytes" << std::endl;
+            std::cout << "page tables " << pt->pageTableBytes() << " bytes peak " << pt->peakPageTableBytes() << " bytes"
+                      << std::endl;
+        }
+        if (budgetMode != BUDGET_FIXED) {
+            long faults = 0;
+            int largest = 0;
+            double total = 0;
+            for (const BudgetSample& sample : pt->series()) {
+                std::cout << "time " << sample.time << " resident " << sample.resident << " fault rate "
+                          << std::fixed << std::setprecision(4) << (double)(sample.faults - faults) / seriesInterval
+                          << std::endl;
+                faults = sample.faults;
+                largest = std::max(largest, sample.resident);
+                total += sample.resident;
+            }
+            std::cout << "resident max " << largest << " mean " << std::setprecision(1)
+                      << (pt->series().empty() ? 0 : total / pt->series().size()) << std::endl;
+            std::cout.unsetf(std::ios::floatfield);
+        }
+        if (swap) {
+            swap->flush();
+            std::cout << std::fixed << std::setprecision(1);
+            std::cout << "swap reads " << swap->reads() << " writes " << swap->writes() << " stall " << swap->stallTime()
+                      << " time " << swap->now() << std::endl;
+        }
+    }
+
     return 0;
 }
\ No newline at end of file
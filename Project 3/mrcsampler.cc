@@ -0,0 +1,180 @@
+#include "mrcsampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+MrcSampler::MrcSampler(double rate, long sampleCap, const std::vector<long>& sizes) {
+    _threshold = (unsigned long)(rate * MRC_HASH_MODULUS);
+    if (_threshold < 1) {
+        _threshold = 1;
+    } else if (_threshold > MRC_HASH_MODULUS) {
+        _threshold = MRC_HASH_MODULUS;
+    }
+    _sampleCap = sampleCap;
+    _sizes = sizes;
+    _hits.assign(sizes.size(), 0);
+    _sampled = 0;
+    _references = 0;
+    _pagesSampled = 0;
+    _tree.assign(sampleCap > 0 ? 2 * sampleCap + 1 : 1025, 0);
+    _clock = 0;
+}
+
+/**
+ * splitmix64 finalizer, so that neighbouring pages are sampled independently.
+ */
+unsigned long MrcSampler::hash(Address8 page) {
+    page = (page ^ (page >> 30)) * 0xbf58476d1ce4e5b9UL;
+    page = (page ^ (page >> 27)) * 0x94d049bb133111ebUL;
+    return page ^ (page >> 31);
+}
+
+void MrcSampler::treeAdd(long time, int value) {
+    for (; time < (long)_tree.size(); time += time & -time) {
+        _tree[time] += value;
+    }
+}
+
+/**
+ * Number of sampled pages last accessed at or before time.
+ */
+long MrcSampler::treeSum(long time) {
+    long sum = 0;
+    for (; time > 0; time -= time & -time) {
+        sum += _tree[time];
+    }
+    return sum;
+}
+
+/**
+ * The clock ran off the end of the tree: renumber the last access times 1..n in the same order. The tree
+ * is doubled only if it would be more than half full, so without a cap it grows with the sample.
+ */
+void MrcSampler::compact() {
+    std::vector<std::pair<long, Address8>> order;
+    order.reserve(_samples.size());
+    for (auto& entry : _samples) {
+        order.push_back(std::make_pair(entry.second.time, entry.first));
+    }
+    std::sort(order.begin(), order.end());
+    long size = _tree.size();
+    while ((long)order.size() * 2 + 1 > size) {
+        size = 2 * size;
+    }
+    _tree.assign(size, 0);
+    _clock = 0;
+    for (auto& entry : order) {
+        _samples[entry.second].time = ++_clock;
+        treeAdd(_clock, 1);
+    }
+}
+
+/**
+ * Drop the sampled page with the largest hash and sample below its hash from now on. What was counted at
+ * the old rate is scaled to the new one.
+ */
+void MrcSampler::lowerThreshold() {
+    std::pair<unsigned long, Address8> largest = _largestHash.top();
+    _largestHash.pop();
+    double scale = (double)(largest.first % MRC_HASH_MODULUS) / _threshold;
+    _threshold = largest.first % MRC_HASH_MODULUS;
+    for (double& hits : _hits) {
+        hits *= scale;
+    }
+    _sampled *= scale;
+    treeAdd(_samples[largest.second].time, -1);
+    _samples.erase(largest.second);
+}
+
+void MrcSampler::access(Address8 page) {
+    _references++;
+    unsigned long h = hash(page);
+    if (h % MRC_HASH_MODULUS >= _threshold) {
+        return;
+    }
+    _sampled++;
+    if (_clock + 1 >= (long)_tree.size()) {
+        compact();
+    }
+    auto found = _samples.find(page);
+    if (found != _samples.end()) {
+        // pages touched since the last access to this one, scaled up from the sample
+        long distance = treeSum(_clock) - treeSum(found->second.time);
+        double scaled = distance * (double)MRC_HASH_MODULUS / _threshold;
+        int k = std::upper_bound(_sizes.begin(), _sizes.end(), (long)scaled) - _sizes.begin();
+        if (k < (int)_sizes.size()) {
+            _hits[k]++;
+        }
+        found->second.bins[k]++;
+        treeAdd(found->second.time, -1);
+        found->second.time = ++_clock;
+        treeAdd(_clock, 1);
+        return;
+    }
+    _pagesSampled++;
+    _samples[page] = Sample{++_clock, h, std::vector<unsigned int>(_sizes.size() + 1, 0)};
+    _samples[page].bins[_sizes.size()]++;
+    treeAdd(_clock, 1);
+    if (_sampleCap > 0) {
+        _largestHash.push(std::make_pair(h % MRC_HASH_MODULUS, page));
+        if ((long)_samples.size() > _sampleCap) {
+            lowerThreshold();
+        }
+    }
+}
+
+double MrcSampler::rate() {
+    return (double)_threshold / MRC_HASH_MODULUS;
+}
+
+long MrcSampler::references() {
+    return _references;
+}
+
+long MrcSampler::pagesSampled() {
+    return _pagesSampled;
+}
+
+/**
+ * Estimated miss ratio with _sizes[k] frames. The sample rarely holds exactly rate x references; the
+ * difference is counted as hits of distance 0 (SHARDS-adj), which matters most for small rates.
+ */
+double MrcSampler::missRatio(int k) {
+    double expected = _references * rate();
+    if (expected <= 0) {
+        return 0;
+    }
+    double hits = expected - _sampled;
+    for (int j = 0; j <= k; j++) {
+        hits += _hits[j];
+    }
+    double ratio = 1 - hits / expected;
+    return ratio < 0 ? 0 : (ratio > 1 ? 1 : ratio);
+}
+
+/**
+ * Half width of a 95% confidence interval for missRatio(k). Whole pages are sampled, so the variance comes
+ * from how unevenly misses are spread over pages: with m and t a page's misses and references, and r the
+ * ratio, it is about (1 - rate) x sum((m - r t)^2) / sum(t)^2 over the sampled pages. A few hot pages left
+ * out of the sample make it wide, as they should. Pages dropped by a lowered threshold are not counted.
+ */
+double MrcSampler::errorBound(int k) {
+    double ratio = missRatio(k);
+    double total = 0, squares = 0;
+    for (auto& entry : _samples) {
+        const std::vector<unsigned int>& bins = entry.second.bins;
+        double references = 0, misses = 0;
+        for (int j = 0; j < (int)bins.size(); j++) {
+            references += bins[j];
+            if (j > k) {
+                misses += bins[j];
+            }
+        }
+        total += references;
+        squares += (misses - ratio * references) * (misses - ratio * references);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    return 1.96 * std::sqrt((1 - rate()) * squares) / total;
+}
\ No newline at end of file
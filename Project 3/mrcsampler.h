@@ -0,0 +1,57 @@
+#ifndef mrcsampler_h_
+#define mrcsampler_h_
+
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "mm2types.h"
+
+#define MRC_HASH_MODULUS (1UL << 24)
+
+/**
+ * Estimates the LRU miss ratio curve of a trace from a spatially hashed sample of its pages (SHARDS).
+ * A page is sampled if hash(page) mod MRC_HASH_MODULUS < threshold, so every access to a sampled page is
+ * seen, and the stack distances among sampled pages, divided by the rate, estimate the full ones.
+ * With a sample cap, the page with the largest hash is dropped and the threshold lowered whenever the
+ * sample would grow past it, so memory stays bounded whatever the trace.
+ * The curve is only kept for the cache sizes given to the constructor.
+ */
+class MrcSampler {
+   private:
+    unsigned long _threshold;
+    long _sampleCap;  // 0 for no cap
+    std::vector<long> _sizes;
+    std::vector<double> _hits;  // _hits[k]: sampled references that hit with _sizes[k] frames but not fewer
+    double _sampled;            // sampled references, scaled like _hits
+    long _references;
+    long _pagesSampled;
+
+    struct Sample {
+        long time;  // last access, on the clock of the distance tree
+        unsigned long hash;
+        std::vector<unsigned int> bins;  // this page's references, binned like _hits; the last bin is misses
+    };
+    std::unordered_map<Address8, Sample> _samples;
+    std::priority_queue<std::pair<unsigned long, Address8>> _largestHash;
+    std::vector<int> _tree;  // Fenwick tree: 1 at the last access time of every sampled page
+    long _clock;
+
+    static unsigned long hash(Address8 page);
+    void treeAdd(long time, int value);
+    long treeSum(long time);
+    void compact();
+    void lowerThreshold();
+
+   public:
+    MrcSampler(double rate, long sampleCap, const std::vector<long>& sizes);
+    void access(Address8 page);
+    double rate();
+    long references();
+    long pagesSampled();
+    double missRatio(int k);
+    double errorBound(int k);
+};
+
+#endif
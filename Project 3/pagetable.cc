@@ -1,10 +1,45 @@
 #include "pagetable.h"
 
 PageTable::PageTable() {
+    _faults = 0;
+    _pt = new PTE[MAX_PAGES];
     for (int i = 0; i < MAX_PAGES; i++) {
         _pt[i].frame = 0;
         _pt[i].valid = false;
+        _pt[i].prefetched = false;
+        _pt[i].dirty = false;
+        _pt[i].referenced = false;
+        _pt[i].onSwap = false;
     }
+    _swap = NULL;
+    for (int i = 0; i < PREFETCH_STREAMS; i++) {
+        _streams[i].lastPage = -1;
+        _streams[i].touched = 0;
+    }
+    _maxWindow = 0;
+    _prefetchIssued = 0;
+    _prefetchUseful = 0;
+    _prefetchWasted = 0;
+    _budgetMode = BUDGET_FIXED;
+    _tau = 0;
+    _lastFaultTimer = 0;
+    _lastFaultTime = 0;
+    _clock = 0;
+    _interval = 0;
+    _hugeOrder = 0;
+    _promote = false;
+    _leafTables = 0;
+    _peakLeafTables = 0;
+    _promotions = 0;
+    _demotions = 0;
+    _smallTlb = NULL;
+    _hugeTlb = NULL;
+}
+
+PageTable::~PageTable() {
+    delete[] _pt;
+    delete _smallTlb;
+    delete _hugeTlb;
 }
 
 int PageTable::alignPhyFrames(PhyFrames* ft) {
@@ -16,35 +51,538 @@ int PageTable::alignPhyFrames(PhyFrames* ft) {
     return 0;
 }
 
-Address8 PageTable::map(Address8 virtualPageNumber) {
-    if (_pt[virtualPageNumber].valid == false) {
-        if (_ft->hasFreeFrameSpace()) {
-            DEBUG("FREE SPACE");
-            Address8 frameNumber = _ft->allocateKnownFreeFrame(virtualPageNumber);
-            _pt[virtualPageNumber].frame = frameNumber;
-            _pt[virtualPageNumber].valid = true;
-            DEBUG(frameNumber);
-            _ft->accessFrame(frameNumber);
+int PageTable::alignSwapDevice(SwapDevice* swap) {
+    if (!swap) {
+        return -1;
+    }
+    _swap = swap;
+
+    return 0;
+}
+
+/**
+ * Turn on adaptive readahead, with at most maxWindow pages mapped ahead of each stream, or off with 0.
+ * The window is kept below half of the frames so that a stream cannot evict its own prefetches.
+ */
+int PageTable::enablePrefetch(int maxWindow) {
+    if (maxWindow != 0 && maxWindow < PREFETCH_MIN_WINDOW) {
+        return -1;
+    }
+    _maxWindow = maxWindow;
+    if (_maxWindow > (MAX_FRAMES - 1) / 2) {
+        _maxWindow = (MAX_FRAMES - 1) / 2;
+    }
+
+    return 0;
+}
+
+/**
+ * Working set mode: after every access, the page accessed tau accesses ago gives its frame back unless it
+ * was accessed again since. One slot per access of the window, so O(1) per access. Every interval
+ * accesses the resident set size is recorded, see series().
+ */
+int PageTable::enableWorkingSet(long tau, long interval) {
+    if (tau < 1 || interval < 1) {
+        return -1;
+    }
+    _budgetMode = BUDGET_WS;
+    _tau = tau;
+    _interval = interval;
+    _windowPage.assign(tau, 0);
+    _windowStamp.assign(tau, 0);
+
+    return 0;
+}
+
+/**
+ * Page fault frequency mode: a fault less than threshold accesses after the previous one gets a new frame.
+ * Otherwise the pages not accessed since the previous fault give their frames back first. An access moves
+ * its frame to the end of a list in access order, so those pages are found at its head: a slow fault only
+ * visits the frames it releases.
+ */
+int PageTable::enablePageFaultFrequency(long threshold, long interval) {
+    if (threshold < 1 || interval < 1) {
+        return -1;
+    }
+    _budgetMode = BUDGET_PFF;
+    _tau = threshold;
+    _interval = interval;
+    _ft->setBudget(1);
+    _accessNext.assign(MAX_FRAMES, -1);
+    _accessPrev.assign(MAX_FRAMES, -1);
+    _accessNext[0] = 0;
+    _accessPrev[0] = 0;
+
+    return 0;
+}
+
+const std::vector<BudgetSample>& PageTable::series() {
+    return _series;
+}
+
+/**
+ * Second page size of 1 << order small pages. With promote, an aligned region whose small pages are all
+ * resident is moved into an aligned block of frames and mapped by one huge entry; evicting any of its pages
+ * splits it again. Without, only the TLB and page table statistics are kept, to compare against.
+ * The frames must hold at least two blocks, as block 0 has the kernel frame.
+ */
+int PageTable::enableHugePages(int order, bool promote) {
+    if (order < 1 || (MAX_FRAMES >> order) < 2) {
+        return -1;
+    }
+    _hugeOrder = order;
+    _promote = promote;
+    long regions = ((long)MAX_PAGES + (1L << order) - 1) >> order;
+    _regionResident.assign(regions, 0);
+    _regionHuge.assign(regions, 0);
+    _blockHuge.assign(MAX_FRAMES >> order, 0);
+    _smallTlb = new Tlb(TLB_SMALL_ENTRIES, TLB_WAYS);
+    _hugeTlb = new Tlb(TLB_HUGE_ENTRIES, TLB_WAYS);
+
+    return 0;
+}
+
+/**
+ * Keep the count of resident pages per region, and with it the number of tables of small entries.
+ */
+void PageTable::countResident(Address8 pageNumber, int delta) {
+    long region = pageNumber >> _hugeOrder;
+    if (!_regionHuge[region]) {
+        if (delta > 0 && _regionResident[region] == 0) {
+            _leafTables++;
+        } else if (delta < 0 && _regionResident[region] == 1) {
+            _leafTables--;
+        }
+    }
+    _regionResident[region] += delta;
+    if (_leafTables > _peakLeafTables) {
+        _peakLeafTables = _leafTables;
+    }
+}
+
+/**
+ * Put a resident page into frameNumber, exchanging with whatever is there.
+ */
+void PageTable::moveToFrame(Address8 pageNumber, Address8 frameNumber) {
+    Address8 from = _pt[pageNumber].frame;
+    if (from == frameNumber) {
+        return;
+    }
+    bool occupied = _ft->lastAccess(frameNumber) != NEVER_USED_AGAIN;
+    Address8 other = _ft->reverse(frameNumber);
+    _ft->exchangeFrames(from, frameNumber);
+    if (_budgetMode == BUDGET_PFF) {
+        exchangeAccess(from, frameNumber);
+    }
+    _pt[pageNumber].frame = frameNumber;
+    _smallTlb->invalidate(pageNumber);
+    if (occupied) {
+        _pt[other].frame = from;
+        _smallTlb->invalidate(other);
+    }
+}
+
+/**
+ * All small pages of region are resident: gather them in an aligned block of frames, the one already
+ * holding most of them, and map the region with one entry. Blocks backing another huge region, block 0
+ * and blocks not handed out yet are not used.
+ */
+void PageTable::promote(long region) {
+    long pages = 1L << _hugeOrder;
+    long blocks = _ft->framesHandedOut() >> _hugeOrder;
+    std::vector<int> held(blocks, 0);
+    for (long i = 0; i < pages; i++) {
+        long block = _pt[(region << _hugeOrder) + i].frame >> _hugeOrder;
+        if (block < blocks) {
+            held[block]++;
+        }
+    }
+    long best = -1;
+    for (long block = 1; block < blocks; block++) {
+        if (!_blockHuge[block] && (best == -1 || held[block] > held[best])) {
+            best = block;
+        }
+    }
+    if (best == -1) {
+        return;
+    }
+    for (long i = 0; i < pages; i++) {
+        moveToFrame((region << _hugeOrder) + i, (best << _hugeOrder) + i);
+        _smallTlb->invalidate((region << _hugeOrder) + i);
+    }
+    _regionHuge[region] = 1;
+    _blockHuge[best] = 1;
+    _leafTables--;
+    _promotions++;
+}
+
+void PageTable::demote(long region) {
+    long block = _pt[region << _hugeOrder].frame >> _hugeOrder;
+    _regionHuge[region] = 0;
+    _blockHuge[block] = 0;
+    _hugeTlb->invalidate(region);
+    _leafTables++;
+    _demotions++;
+}
+
+long PageTable::promotions() {
+    return _promotions;
+}
+
+long PageTable::demotions() {
+    return _demotions;
+}
+
+long PageTable::tlbHits() {
+    return _smallTlb ? _smallTlb->hits() + _hugeTlb->hits() : 0;
+}
+
+long PageTable::tlbMisses() {
+    return _smallTlb ? _smallTlb->misses() + _hugeTlb->misses() : 0;
+}
+
+/**
+ * Bytes of memory covered by the TLB entries in use now.
+ */
+long PageTable::tlbReach() {
+    if (!_smallTlb) {
+        return 0;
+    }
+    return ((long)_smallTlb->valid() << ADDR_PAGE_OFFSET_BIT) +
+           ((long)_hugeTlb->valid() << (ADDR_PAGE_OFFSET_BIT + _hugeOrder));
+}
+
+/**
+ * Memory taken by the tables of small entries, 8 bytes per entry, a table per region. A huge region needs
+ * none: its single entry sits in the level above, which is not counted.
+ */
+long PageTable::pageTableBytes() {
+    return (_leafTables << _hugeOrder) * sizeof(PTE);
+}
+
+long PageTable::peakPageTableBytes() {
+    return (_peakLeafTables << _hugeOrder) * sizeof(PTE);
+}
+
+/**
+ * Unmap the page held by a frame about to be reused or given back. A huge region is split first.
+ */
+void PageTable::evict(Address8 frameNumber) {
+    Address8 oldPageNumber = _ft->reverse(frameNumber);
+    if (_hugeOrder > 0) {
+        if (_regionHuge[oldPageNumber >> _hugeOrder]) {
+            demote(oldPageNumber >> _hugeOrder);
+        }
+        countResident(oldPageNumber, -1);
+        _smallTlb->invalidate(oldPageNumber);
+    }
+    _pt[oldPageNumber].valid = false;
+    _pt[oldPageNumber].referenced = false;
+    if (_pt[oldPageNumber].dirty) {
+        // only dirty victims cost a write, clean ones still have their copy on swap (or were never written)
+        _pt[oldPageNumber].dirty = false;
+        _pt[oldPageNumber].onSwap = true;
+        if (_swap) {
+            _swap->writeBack();
+        }
+    }
+    if (_pt[oldPageNumber].prefetched) {
+        // evicted before anybody used it: the stream that brought it reads too far ahead
+        _pt[oldPageNumber].prefetched = false;
+        _prefetchWasted++;
+        PrefetchStream* stream = findStream(oldPageNumber, true);
+        if (stream) {
+            stream->window = stream->window / 2 > PREFETCH_MIN_WINDOW ? stream->window / 2 : PREFETCH_MIN_WINDOW;
+            stream->hits = 0;
+        }
+    }
+}
+
+/**
+ * Take a resident page out of memory and give its frame back to PhyFrames.
+ */
+void PageTable::release(Address8 pageNumber) {
+    Address8 frameNumber = _pt[pageNumber].frame;
+    evict(frameNumber);
+    _ft->releaseFrame(frameNumber);
+}
+
+void PageTable::unlinkAccess(int frame) {
+    if (_accessPrev[frame] < 0) {
+        return;
+    }
+    _accessNext[_accessPrev[frame]] = _accessNext[frame];
+    _accessPrev[_accessNext[frame]] = _accessPrev[frame];
+    _accessNext[frame] = -1;
+    _accessPrev[frame] = -1;
+}
+
+void PageTable::linkAccess(int frame, int after) {
+    _accessNext[frame] = _accessNext[after];
+    _accessPrev[frame] = after;
+    _accessPrev[_accessNext[after]] = frame;
+    _accessNext[after] = frame;
+}
+
+/**
+ * The frame was just accessed: move it to the end of the access list.
+ */
+void PageTable::touchAccess(int frame) {
+    unlinkAccess(frame);
+    linkAccess(frame, _accessPrev[0]);
+}
+
+/**
+ * Two frames exchanged their contents and access times: exchange their places in the access list too.
+ */
+void PageTable::exchangeAccess(int a, int b) {
+    int beforeA = _accessPrev[a];
+    int beforeB = _accessPrev[b];
+    if (beforeB == a) {
+        unlinkAccess(b);
+        linkAccess(b, beforeA);
+    } else if (beforeA == b) {
+        unlinkAccess(a);
+        linkAccess(a, beforeB);
+    } else {
+        // a free frame is not in the list: the other one just takes its place, or nothing happens
+        unlinkAccess(a);
+        unlinkAccess(b);
+        if (beforeA >= 0) {
+            linkAccess(b, beforeA);
+        }
+        if (beforeB >= 0) {
+            linkAccess(a, beforeB);
+        }
+    }
+}
+
+/**
+ * PFF controller, called on a fault before the page is brought in.
+ */
+void PageTable::adjustBudget() {
+    if (_clock - _lastFaultTime >= _tau) {
+        // faulting slowly: drop what was not used since the previous fault, the head of the access list
+        for (int frame = _accessNext[0]; frame != 0 && _ft->lastAccess(frame) < _lastFaultTimer;
+             frame = _accessNext[0]) {
+            unlinkAccess(frame);
+            release(_ft->reverse(frame));
+        }
+    }
+    _ft->setBudget(_ft->resident() + 1);
+    _lastFaultTime = _clock;
+    _lastFaultTimer = _ft->timer();
+}
+
+/**
+ * Bring a page into a free frame, or into the victim frame of the replacement policy. A prefetched page
+ * is not counted as accessed, see PhyFrames::touchFrame().
+ */
+Address8 PageTable::load(Address8 virtualPageNumber, bool prefetch) {
+    Address8 frameNumber;
+    if (_ft->hasFreeFrameSpace()) {
+        DEBUG("FREE SPACE");
+        frameNumber = _ft->allocateKnownFreeFrame(virtualPageNumber);
+    } else {
+        DEBUG("SWAP");
+        frameNumber = _ft->victimFrame();
+        if (frameNumber == (Address8)-1) {
+            DEBUG("ERROR: FAILED TO LOCATE VICTIM FRAME");
+        }
+
+        evict(frameNumber);
+        _ft->swap(frameNumber, virtualPageNumber);
+    }
+    _pt[virtualPageNumber].frame = frameNumber;
+    _pt[virtualPageNumber].valid = true;
+    _pt[virtualPageNumber].prefetched = prefetch;
+    _pt[virtualPageNumber].referenced = !prefetch;
+    if (_swap && _pt[virtualPageNumber].onSwap) {
+        _swap->read();  // pages never written out are zero-filled for free
+    }
+    DEBUG(frameNumber);
+    if (prefetch) {
+        _ft->touchFrame(frameNumber);
+    } else {
+        _ft->accessFrame(frameNumber);
+    }
+    if (_hugeOrder > 0) {
+        countResident(virtualPageNumber, 1);
+        long region = virtualPageNumber >> _hugeOrder;
+        if (_promote && _regionResident[region] == 1L << _hugeOrder) {
+            promote(region);
+        }
+    }
+
+    return _pt[virtualPageNumber].frame;
+}
+
+/**
+ * Stream responsible for pageNumber. With ahead, only a stream that has pageNumber inside its
+ * readahead window matches; otherwise any stream whose region is near pageNumber does.
+ */
+PrefetchStream* PageTable::findStream(long pageNumber, bool ahead) {
+    PrefetchStream* best = NULL;
+    long bestDistance = PREFETCH_DISTANCE + 1;
+    for (int i = 0; i < PREFETCH_STREAMS; i++) {
+        PrefetchStream* stream = &_streams[i];
+        if (stream->lastPage < 0) {
+            continue;
+        }
+        long distance = pageNumber - stream->lastPage;
+        if (ahead) {
+            if (stream->active && distance % stream->stride == 0 && distance / stream->stride > 0 &&
+                distance / stream->stride <= _maxWindow) {
+                return stream;
+            }
         } else {
-            DEBUG("SWAP");
-            Address8 frameNumber = _ft->leastRecentlyUsedFrame();
-            if (frameNumber == -1) {
-                DEBUG("ERROR: FAILED TO LOCATE LRU FRAME");
+            if (distance < 0) {
+                distance = -distance;
+            }
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = stream;
+            }
+        }
+    }
+    return best;
+}
+
+/**
+ * Keep stream->window pages mapped ahead of stream->lastPage. The frame of stream->lastPage, the page
+ * map() is about to return, is pinned meanwhile so that no prefetch can take it.
+ */
+void PageTable::prefetchAhead(PrefetchStream* stream) {
+    _ft->pin(_pt[stream->lastPage].frame);
+    for (int k = 1; k <= stream->window; k++) {
+        long page = stream->lastPage + k * stream->stride;
+        if (page < 0 || page >= MAX_PAGES) {
+            break;
+        }
+        if (_pt[page].valid == false) {
+            load(page, true);
+            _prefetchIssued++;
+        }
+    }
+    _ft->pin(0);
+}
+
+void PageTable::onFault(long pageNumber) {
+    PrefetchStream* stream = findStream(pageNumber, false);
+    if (stream == NULL) {
+        // new region: recycle the least recently used slot
+        stream = &_streams[0];
+        for (int i = 1; i < PREFETCH_STREAMS; i++) {
+            if (_streams[i].touched < stream->touched) {
+                stream = &_streams[i];
             }
+        }
+        stream->lastPage = pageNumber;
+        stream->stride = 0;
+        stream->active = false;
+        stream->window = PREFETCH_MIN_WINDOW;
+        stream->hits = 0;
+    } else {
+        long stride = pageNumber - stream->lastPage;
+        stream->active = stride != 0 && stride == stream->stride;
+        stream->stride = stride;
+        stream->lastPage = pageNumber;
+    }
+    stream->touched = _faults;
+    if (stream->active) {
+        prefetchAhead(stream);
+    }
+}
+
+void PageTable::onPrefetchHit(long pageNumber) {
+    _prefetchUseful++;
+    PrefetchStream* stream = findStream(pageNumber, true);
+    if (stream == NULL) {
+        return;
+    }
+    // a full window used: read further ahead
+    stream->hits++;
+    if (stream->hits >= stream->window && stream->window < _maxWindow) {
+        stream->window = stream->window * 2 < _maxWindow ? stream->window * 2 : _maxWindow;
+        stream->hits = 0;
+    }
+    stream->lastPage = pageNumber;
+    stream->touched = _faults;
+    prefetchAhead(stream);
+}
 
-            Address8 oldPageNumber = _ft->reverse(frameNumber);
-            _pt[oldPageNumber].valid = false;
-            _ft->swap(frameNumber, virtualPageNumber);
-            _pt[virtualPageNumber].frame = frameNumber;
-            _pt[virtualPageNumber].valid = true;
-            DEBUG(frameNumber);
-            _ft->accessFrame(frameNumber);
+Address8 PageTable::map(Address8 virtualPageNumber, bool isWrite) {
+    if (_swap) {
+        _swap->tick(1);
+    }
+    if (_pt[virtualPageNumber].valid == false) {
+        _faults++;
+        if (_budgetMode == BUDGET_PFF) {
+            adjustBudget();
+        }
+        load(virtualPageNumber);
+        if (_maxWindow > 0) {
+            onFault(virtualPageNumber);
         }
     } else {
         DEBUG("VALID");
         DEBUG(_pt[virtualPageNumber].frame);
         _ft->accessFrame(_pt[virtualPageNumber].frame);
+        _pt[virtualPageNumber].referenced = true;
+        if (_pt[virtualPageNumber].prefetched) {
+            _pt[virtualPageNumber].prefetched = false;
+            onPrefetchHit(virtualPageNumber);
+        }
+    }
+    if (isWrite) {
+        _pt[virtualPageNumber].dirty = true;
+    }
+    if (_smallTlb) {
+        long region = virtualPageNumber >> _hugeOrder;
+        if (_regionHuge[region]) {
+            _hugeTlb->lookup(region);
+        } else {
+            _smallTlb->lookup(virtualPageNumber);
+        }
+    }
+    if (_budgetMode != BUDGET_FIXED) {
+        if (_budgetMode == BUDGET_PFF) {
+            touchAccess(_pt[virtualPageNumber].frame);
+        } else {
+            long slot = _clock % _tau;
+            Address8 expired = _windowPage[slot];
+            if (_windowStamp[slot] != 0 && _pt[expired].valid &&
+                _ft->lastAccess(_pt[expired].frame) == _windowStamp[slot]) {
+                release(expired);  // left the working set
+            }
+            _windowPage[slot] = virtualPageNumber;
+            _windowStamp[slot] = _ft->lastAccess(_pt[virtualPageNumber].frame);
+        }
+        _clock++;
+        if (_clock % _interval == 0) {
+            _series.push_back(BudgetSample{_clock, _ft->resident(), _faults});
+        }
     }
 
     return _pt[virtualPageNumber].frame;
+}
+
+long PageTable::faults() {
+    return _faults;
+}
+
+long PageTable::prefetchIssued() {
+    return _prefetchIssued;
+}
+
+long PageTable::prefetchUseful() {
+    return _prefetchUseful;
+}
+
+long PageTable::prefetchWasted() {
+    return _prefetchWasted;
+}
+
+bool PageTable::isDirty(Address8 pageNumber) {
+    return _pt[pageNumber].dirty;
 }
\ No newline at end of file
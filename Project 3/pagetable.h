@@ -1,12 +1,52 @@
 #ifndef pagetable_h_
 #define pagetable_h_
 
+#include <vector>
+
 #include "mm2types.h"
 #include "phyframes.h"
+#include "swapdevice.h"
+#include "tlb.h"
 
+// Packed into 8 bytes, so that 8 entries share a cache line.
 struct PTE {
-    Address8 frame;  // 0 for kernel
-    bool valid;      // true if in memory
+    Address8 frame : 56;     // 0 for kernel
+    Address8 valid : 1;      // true if in memory
+    Address8 prefetched : 1; // mapped by readahead and not accessed since
+    Address8 dirty : 1;      // written since it was brought in
+    Address8 referenced : 1; // accessed since it was brought in
+    Address8 onSwap : 1;     // a copy is on the swap device, so bringing it in needs a read
+};
+static_assert(sizeof(PTE) == 8, "PTE must stay packed");
+
+#define PREFETCH_STREAMS 8    // readahead streams tracked at the same time
+#define PREFETCH_DISTANCE 16  // a fault within this many pages of a stream belongs to its region
+#define PREFETCH_MIN_WINDOW 1
+
+// Readahead state of one region. Two faults in a row with the same stride make it a stream, which then
+// keeps `window` pages mapped ahead of `lastPage`.
+struct PrefetchStream {
+    long lastPage;  // last demand-faulted or prefetch-hit page, -1 if the slot is unused
+    long stride;
+    bool active;    // stride confirmed
+    int window;
+    int hits;       // useful prefetches since the window last grew
+    long touched;   // fault counter at last use, to recycle the least recently used slot
+};
+
+#define BUDGET_FIXED 0  // all frames, with the replacement policy of PhyFrames
+#define BUDGET_WS 1     // working set: a page not accessed in the last tau accesses gives its frame back
+#define BUDGET_PFF 2    // page fault frequency: grow on faults closer than the threshold, else shrink
+
+#define TLB_SMALL_ENTRIES 64
+#define TLB_HUGE_ENTRIES 32
+#define TLB_WAYS 4
+
+// Point of the resident set size time series, taken every interval accesses.
+struct BudgetSample {
+    long time;      // accesses so far
+    int resident;   // frames in use
+    long faults;    // faults so far
 };
 
 class PhyFrames;  // to resolve circuit dependency
@@ -15,14 +55,81 @@ class PhyFrames;  // to resolve circuit dependency
  * NOTICE: Must align a PhyFrames before using.
  */
 class PageTable {
+   friend class Snapshot;  // saves and restores the private state
+
    private:
-    PTE _pt[ASSUMED_MAX_PAGES];
+    PTE* _pt;  // MAX_PAGES entries
     PhyFrames* _ft;
+    SwapDevice* _swap;  // NULL if swap I/O is not simulated
+    long _faults;
+    PrefetchStream _streams[PREFETCH_STREAMS];
+    int _maxWindow;  // 0 if readahead is off
+    long _prefetchIssued;
+    long _prefetchUseful;
+    long _prefetchWasted;
+    int _budgetMode;
+    long _tau;                          // WS window, or PFF interfault threshold, in accesses
+    std::vector<Address8> _windowPage;  // WS: page of each of the last tau accesses, by time modulo tau
+    std::vector<long> _windowStamp;     // WS: PhyFrames timer of that access, 0 if none
+    long _lastFaultTimer;               // PFF: PhyFrames timer at the previous fault
+    std::vector<int> _accessNext;       // PFF: resident frames from least to most recently accessed, a circular
+    std::vector<int> _accessPrev;       //      list through frame 0 (the kernel's); -1 if not in it
+    long _lastFaultTime;
+    long _clock;                        // accesses so far
+    long _interval;
+    std::vector<BudgetSample> _series;
+    int _hugeOrder;                    // a huge page is 1 << _hugeOrder small ones; 0 if off
+    bool _promote;                     // false: only count TLB and page table use as if regions were never huge
+    std::vector<int> _regionResident;  // resident small pages of each aligned region
+    std::vector<char> _regionHuge;     // region mapped by one huge entry
+    std::vector<char> _blockHuge;      // aligned block of frames backing a huge region
+    long _leafTables;                  // regions that need a table of small entries
+    long _peakLeafTables;
+    long _promotions;
+    long _demotions;
+    Tlb* _smallTlb;  // NULL if off
+    Tlb* _hugeTlb;
+
+    Address8 load(Address8 pageNumber, bool prefetch = false);
+    void evict(Address8 frameNumber);
+    void release(Address8 pageNumber);
+    void adjustBudget();
+    void unlinkAccess(int frame);
+    void linkAccess(int frame, int after);
+    void touchAccess(int frame);
+    void exchangeAccess(int a, int b);
+    void countResident(Address8 pageNumber, int delta);
+    void promote(long region);
+    void demote(long region);
+    void moveToFrame(Address8 pageNumber, Address8 frameNumber);
+    PrefetchStream* findStream(long pageNumber, bool ahead);
+    void prefetchAhead(PrefetchStream* stream);
+    void onFault(long pageNumber);
+    void onPrefetchHit(long pageNumber);
 
    public:
     PageTable();
+    ~PageTable();
     int alignPhyFrames(PhyFrames* ft);
-    Address8 map(Address8 pageNumber);
+    int alignSwapDevice(SwapDevice* swap);
+    int enablePrefetch(int maxWindow);
+    int enableWorkingSet(long tau, long interval);
+    int enablePageFaultFrequency(long threshold, long interval);
+    const std::vector<BudgetSample>& series();
+    int enableHugePages(int order, bool promote);
+    long promotions();
+    long demotions();
+    long tlbHits();
+    long tlbMisses();
+    long tlbReach();
+    long pageTableBytes();
+    long peakPageTableBytes();
+    Address8 map(Address8 pageNumber, bool isWrite = false);
+    bool isDirty(Address8 pageNumber);
+    long faults();
+    long prefetchIssued();
+    long prefetchUseful();
+    long prefetchWasted();
 };
 
 #endif
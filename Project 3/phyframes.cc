@@ -1,14 +1,35 @@
 #include "phyframes.h"
 
+#include <utility>
+
 PhyFrames::PhyFrames() {
     _freeFramePointer = 1;  // frame 0 is for kernel
+    _resident = 0;
+    _budget = MAX_FRAMES - 1;
     _globalTimer = 1;
+    _policy = POLICY_LRU;
+    _cleanWindow = MAX_FRAMES / 4 > 1 ? MAX_FRAMES / 4 : 1;
+    _pinned = 0;
+    _nextUse = NEVER_USED_AGAIN;
+    _page = new Address8[MAX_FRAMES];
+    _counter = new long[MAX_FRAMES];
+    _nextUseOf = new long[MAX_FRAMES];
+    _heapSlot = new int[MAX_FRAMES];
     for (int i = 0; i < MAX_FRAMES; i++) {
-        _ft[i].page = 0;
-        _ft[i].counter = 0;
+        _page[i] = 0;
+        _counter[i] = 0;
+        _nextUseOf[i] = NEVER_USED_AGAIN;
+        _heapSlot[i] = -1;
     }
 }
 
+PhyFrames::~PhyFrames() {
+    delete[] _page;
+    delete[] _counter;
+    delete[] _nextUseOf;
+    delete[] _heapSlot;
+}
+
 int PhyFrames::alignPageTable(PageTable* pt) {
     if (!pt) {
         return -1;
@@ -19,46 +40,348 @@ int PhyFrames::alignPageTable(PageTable* pt) {
 }
 
 Address8 PhyFrames::reverse(Address8 frameNumber) {
-    return _ft[frameNumber].page;
+    return _page[frameNumber];
 }
 
 bool PhyFrames::hasFreeFrameSpace() {
-    return _freeFramePointer < MAX_FRAMES;
+    return _resident < _budget && (!_freeFrames.empty() || _freeFramePointer < MAX_FRAMES);
 }
 
 Address8 PhyFrames::allocateKnownFreeFrame(Address8 reversePage) {
-    ReverseMappingTableEntry fte;
-    fte.page = reversePage;
-    fte.counter = _globalTimer;
-    int frame = _freeFramePointer;
-    _ft[frame] = fte;
-    _freeFramePointer++;
+    int frame;
+    if (!_freeFrames.empty()) {
+        frame = _freeFrames.back();
+        _freeFrames.pop_back();
+    } else {
+        frame = _freeFramePointer;
+        _freeFramePointer++;
+    }
+    _page[frame] = reversePage;
+    _counter[frame] = _globalTimer;
+    _resident++;
 
     return frame;
 }
 
+/**
+ * Give back a frame whose page the PageTable has unmapped. Its counter is set past every other one so
+ * that victim searches pass it over, and it leaves the OPT heap.
+ */
+int PhyFrames::releaseFrame(Address8 frameNumber) {
+    if (frameNumber < 1 || frameNumber >= (Address8)_freeFramePointer || _counter[frameNumber] == NEVER_USED_AGAIN) {
+        return -1;
+    }
+    _counter[frameNumber] = NEVER_USED_AGAIN;
+    heapRemove(frameNumber);
+    _freeFrames.push_back(frameNumber);
+    _resident--;
+
+    return 0;
+}
+
+/**
+ * Swap what two frames hold, page and replacement state, as when the contents are copied across. A free
+ * frame stays free at its new place. The PageTable fixes its entries.
+ */
+int PhyFrames::exchangeFrames(Address8 a, Address8 b) {
+    if (a < 1 || b < 1 || a >= (Address8)_freeFramePointer || b >= (Address8)_freeFramePointer) {
+        return -1;
+    }
+    for (int& frame : _freeFrames) {
+        if (frame == (int)a) {
+            frame = b;
+        } else if (frame == (int)b) {
+            frame = a;
+        }
+    }
+    std::swap(_page[a], _page[b]);
+    std::swap(_counter[a], _counter[b]);
+    std::swap(_nextUseOf[a], _nextUseOf[b]);
+    // the keys moved with the frames, so the heap only needs to know where each frame now sits
+    std::swap(_heapSlot[a], _heapSlot[b]);
+    if (_heapSlot[a] >= 0) {
+        _farthest[_heapSlot[a]] = a;
+    }
+    if (_heapSlot[b] >= 0) {
+        _farthest[_heapSlot[b]] = b;
+    }
+
+    return 0;
+}
+
+/**
+ * Hand out at most frames frames from now on. Frames already in use above it are not taken back.
+ */
+int PhyFrames::setBudget(int frames) {
+    if (frames < 1) {
+        frames = 1;
+    } else if (frames > MAX_FRAMES - 1) {
+        frames = MAX_FRAMES - 1;
+    }
+    _budget = frames;
+
+    return 0;
+}
+
+int PhyFrames::budget() {
+    return _budget;
+}
+
+int PhyFrames::resident() {
+    return _resident;
+}
+
+/**
+ * Frames 1 .. framesHandedOut() - 1 hold a page or are on the free list.
+ */
+int PhyFrames::framesHandedOut() {
+    return _freeFramePointer;
+}
+
+/**
+ * Timer value of the last access to the frame, NEVER_USED_AGAIN if it is free.
+ */
+long PhyFrames::lastAccess(Address8 frameNumber) {
+    return _counter[frameNumber];
+}
+
+long PhyFrames::timer() {
+    return _globalTimer;
+}
+
 Address8 PhyFrames::leastRecentlyUsedFrame() {
-    int lruFrame = 1, lruCounter = _ft[1].counter;  // frame 0 is for kernel
-    for (int i = 2; i < MAX_FRAMES; i++) {
-        if (_ft[i].counter < lruCounter) {
-            lruCounter = _ft[i].counter;
+    // the pinned frame is hidden as if free for the scan, which keeps the loop to a single comparison
+    long pinnedCounter = _counter[_pinned];
+    _counter[_pinned] = NEVER_USED_AGAIN;
+    int lruFrame = 1;  // frame 0 is for kernel
+    long lruCounter = _counter[1];
+    for (int i = 2; i < _freeFramePointer; i++) {
+        if (_counter[i] < lruCounter) {
+            lruCounter = _counter[i];
             lruFrame = i;
         }
     }
+    _counter[_pinned] = pinnedCounter;
 
     return lruFrame;
 }
 
+void PhyFrames::heapSwap(int i, int j) {
+    std::swap(_farthest[i], _farthest[j]);
+    _heapSlot[_farthest[i]] = i;
+    _heapSlot[_farthest[j]] = j;
+}
+
+void PhyFrames::siftUp(int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (_nextUseOf[_farthest[parent]] >= _nextUseOf[_farthest[i]]) {
+            break;
+        }
+        heapSwap(i, parent);
+        i = parent;
+    }
+}
+
+void PhyFrames::siftDown(int i) {
+    int size = _farthest.size();
+    while (true) {
+        int largest = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < size; child++) {
+            if (_nextUseOf[_farthest[child]] > _nextUseOf[_farthest[largest]]) {
+                largest = child;
+            }
+        }
+        if (largest == i) {
+            break;
+        }
+        heapSwap(i, largest);
+        i = largest;
+    }
+}
+
+/**
+ * Put a frame into the OPT heap, or move it to its place after its key changed.
+ */
+void PhyFrames::heapUpdate(int frame) {
+    if (_heapSlot[frame] < 0) {
+        _heapSlot[frame] = _farthest.size();
+        _farthest.push_back(frame);
+    }
+    siftUp(_heapSlot[frame]);
+    siftDown(_heapSlot[frame]);
+}
+
+void PhyFrames::heapRemove(int frame) {
+    int i = _heapSlot[frame];
+    if (i < 0) {
+        return;
+    }
+    int last = _farthest.size() - 1;
+    if (i != last) {
+        heapSwap(i, last);
+    }
+    _farthest.pop_back();
+    _heapSlot[frame] = -1;
+    if (i < last) {
+        int moved = _farthest[i];
+        siftUp(i);
+        siftDown(_heapSlot[moved]);
+    }
+}
+
+/**
+ * Make the OPT heap hold exactly the resident frames, keyed by _nextUseOf; empty under other policies.
+ */
+void PhyFrames::rebuildHeap() {
+    _farthest.clear();
+    for (int i = 0; i < MAX_FRAMES; i++) {
+        _heapSlot[i] = -1;
+    }
+    if (_policy != POLICY_OPT) {
+        return;
+    }
+    for (int i = 1; i < _freeFramePointer; i++) {
+        if (_counter[i] != NEVER_USED_AGAIN) {
+            _heapSlot[i] = _farthest.size();
+            _farthest.push_back(i);
+        }
+    }
+    for (int i = (int)_farthest.size() / 2 - 1; i >= 0; i--) {
+        siftDown(i);
+    }
+}
+
+/**
+ * OPT victim: top of a max-heap keyed by next use with one slot per resident frame. An access changes
+ * the key of its frame in place, so the heap never holds more than F entries and each access is O(log F).
+ */
+Address8 PhyFrames::farthestNextUseFrame() {
+    if (_farthest.empty()) {
+        return leastRecentlyUsedFrame();  // only if setNextUse() was never called
+    }
+    return _farthest[0];
+}
+
+/**
+ * CFLRU victim: evicting a clean page costs no write-back, so among the _cleanWindow least recently used
+ * frames take the oldest clean one. Fall back to plain LRU if they are all dirty.
+ */
+Address8 PhyFrames::cleanFirstFrame() {
+    int lruFrame = leastRecentlyUsedFrame();
+    int cleanFrame = -1;
+    long cleanCounter = 0;
+    for (int i = 1; i < _freeFramePointer; i++) {
+        if (_counter[i] != NEVER_USED_AGAIN && i != _pinned && !_pt->isDirty(_page[i]) &&
+            (cleanFrame == -1 || _counter[i] < cleanCounter)) {
+            cleanCounter = _counter[i];
+            cleanFrame = i;
+        }
+    }
+    if (cleanFrame == -1) {
+        return lruFrame;
+    }
+    // rank of the clean frame in LRU order
+    int older = 0;
+    for (int i = 1; i < _freeFramePointer; i++) {
+        if (_counter[i] < cleanCounter) {
+            older++;
+        }
+    }
+
+    return older < _cleanWindow ? cleanFrame : lruFrame;
+}
+
+Address8 PhyFrames::victimFrame() {
+    if (_policy == POLICY_OPT) {
+        return farthestNextUseFrame();
+    }
+    if (_policy == POLICY_CFLRU) {
+        return cleanFirstFrame();
+    }
+    return leastRecentlyUsedFrame();
+}
+
+int PhyFrames::setPolicy(int policy) {
+    if (policy != POLICY_LRU && policy != POLICY_OPT && policy != POLICY_CFLRU) {
+        return -1;
+    }
+    if (policy != _policy) {
+        _policy = policy;
+        rebuildHeap();
+    }
+
+    return 0;
+}
+
+int PhyFrames::setCleanWindow(int window) {
+    if (window < 1) {
+        return -1;
+    }
+    _cleanWindow = window;
+
+    return 0;
+}
+
+/**
+ * OPT only: tell the index of the next access to the page about to be mapped, NEVER_USED_AGAIN if none.
+ */
+int PhyFrames::setNextUse(long nextUse) {
+    _nextUse = nextUse;
+
+    return 0;
+}
+
+/**
+ * OPT only: set the next use of the page a frame already holds, e.g. after resuming from a snapshot taken
+ * under another policy.
+ */
+int PhyFrames::setFrameNextUse(Address8 frameNumber, long nextUse) {
+    if (frameNumber < 1 || frameNumber >= (Address8)_freeFramePointer || _counter[frameNumber] == NEVER_USED_AGAIN) {
+        return -1;
+    }
+    _nextUseOf[frameNumber] = nextUse;
+    if (_policy == POLICY_OPT) {
+        heapUpdate(frameNumber);
+    }
+
+    return 0;
+}
+
 int PhyFrames::swap(Address8 swappedFrameNumber, Address8 reversePage) {
-    _ft[swappedFrameNumber].page = reversePage;
-    _ft[swappedFrameNumber].counter = _globalTimer;
+    _page[swappedFrameNumber] = reversePage;
+    _counter[swappedFrameNumber] = _globalTimer;
+
+    return 0;
+}
+
+/**
+ * A frame loaded without being accessed, by readahead: it takes the time of the latest access instead of
+ * a new one, so that everything accessed after it ranks as more recently used.
+ */
+int PhyFrames::touchFrame(Address8 frameNumber) {
+    _counter[frameNumber] = _globalTimer - 1;
+
+    return 0;
+}
+
+/**
+ * Keep a frame from being chosen as victim until pin(0), e.g. the frame a fault has just filled while
+ * readahead loads more pages.
+ */
+int PhyFrames::pin(Address8 frameNumber) {
+    _pinned = frameNumber;
 
     return 0;
 }
 
 int PhyFrames::accessFrame(Address8 frameNumber) {
-    _ft[frameNumber].counter = _globalTimer;
+    _counter[frameNumber] = _globalTimer;
     _globalTimer++;
+    if (_policy == POLICY_OPT) {
+        _nextUseOf[frameNumber] = _nextUse;
+        heapUpdate(frameNumber);
+    }
 
     return 0;
 }
\ No newline at end of file
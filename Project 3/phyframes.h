@@ -1,13 +1,16 @@
 #ifndef phyframes_h_
 #define phyframes_h_
 
+#include <vector>
+
 #include "mm2types.h"
 #include "pagetable.h"
 
-struct ReverseMappingTableEntry {
-    Address8 page;
-    int counter;  // Counter for LRU page swapping algorithm usage.
-};
+#define POLICY_LRU 0
+#define POLICY_OPT 1    // Belady: evict the frame whose page is used again farthest in the future.
+#define POLICY_CFLRU 2  // clean-first LRU: the oldest clean frame among the window least recently used ones.
+
+#define NEVER_USED_AGAIN 0x7fffffffffffffffL
 
 class PageTable;  // to resolve circuit dependency
 
@@ -15,21 +18,60 @@ class PageTable;  // to resolve circuit dependency
  * NOTICE: Must align a PageTable before using.
  */
 class PhyFrames {
+   friend class Snapshot;
+
    private:
-    ReverseMappingTableEntry _ft[ASSUMED_MAX_FRAMES];
+    // The frame table is kept as separate arrays: the LRU scan only walks _counter.
+    Address8* _page;  // reverse mapping: page held by each frame
+    long* _counter;   // Counter for LRU page swapping algorithm usage.
     PageTable* _pt;
     int _freeFramePointer;
-    int _globalTimer;
+    std::vector<int> _freeFrames;  // frames given back by releaseFrame(), reused first
+    int _resident;                 // frames holding a page
+    int _budget;                   // at most this many frames are handed out, all but frame 0 by default
+    long _globalTimer;
+    int _policy;
+    int _cleanWindow;               // CFLRU: how many least recently used frames are searched for a clean one
+    int _pinned;                    // never chosen as victim, 0 if none
+    long _nextUse;                  // OPT: next use of the page being accessed now, see setNextUse()
+    long* _nextUseOf;               // OPT: next use of the page held by each frame
+    int* _heapSlot;                 // OPT: index of each frame in _farthest, -1 if not in it
+    std::vector<int> _farthest;     // OPT: max-heap of the resident frames keyed by _nextUseOf
+
+    void heapSwap(int i, int j);
+    void siftUp(int i);
+    void siftDown(int i);
+    void heapUpdate(int frame);
+    void heapRemove(int frame);
+    void rebuildHeap();
 
    public:
     PhyFrames();
+    ~PhyFrames();
     int alignPageTable(PageTable* pt);
     Address8 reverse(Address8 frameNumber);
     bool hasFreeFrameSpace();
     Address8 allocateKnownFreeFrame(Address8 reversePage);
+    int releaseFrame(Address8 frameNumber);
+    int exchangeFrames(Address8 a, Address8 b);
+    int setBudget(int frames);
+    int budget();
+    int resident();
+    int framesHandedOut();
+    long lastAccess(Address8 frameNumber);
+    long timer();
     Address8 leastRecentlyUsedFrame();
+    Address8 farthestNextUseFrame();
+    Address8 cleanFirstFrame();
+    Address8 victimFrame();
+    int setPolicy(int policy);
+    int setCleanWindow(int window);
+    int setNextUse(long nextUse);
+    int setFrameNextUse(Address8 frameNumber, long nextUse);
     int swap(Address8 swappedFrameNumber, Address8 reversePage);
     int accessFrame(Address8 frameNumber);
+    int touchFrame(Address8 frameNumber);
+    int pin(Address8 frameNumber);
 };
 
 #endif
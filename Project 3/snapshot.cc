@@ -0,0 +1,440 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+class SnapshotWriter {
+   public:
+    FILE* file;
+    long offset;
+
+    void put(const void* data, size_t size) {
+        static const char padding[8] = {0};
+        if (size > 0) {
+            fwrite(data, 1, size, file);
+        }
+        offset += size;
+        fwrite(padding, 1, (8 - offset % 8) % 8, file);
+        offset += (8 - offset % 8) % 8;
+    }
+    template <typename T>
+    void value(const T& data) {
+        put(&data, sizeof(T));
+    }
+    template <typename T>
+    void vector(const std::vector<T>& data) {
+        value((unsigned long)data.size());
+        put(data.data(), data.size() * sizeof(T));
+    }
+};
+
+class SnapshotReader {
+   public:
+    const unsigned char* cursor;
+    const unsigned char* end;
+    bool failed;
+
+    void get(void* data, size_t size) {
+        size_t padded = (size + 7) / 8 * 8;
+        if (failed || cursor + padded > end) {
+            failed = true;
+            return;
+        }
+        if (size > 0) {
+            memcpy(data, cursor, size);
+        }
+        cursor += padded;
+    }
+    template <typename T>
+    void value(T& data) {
+        get(&data, sizeof(T));
+    }
+    // A value the run was already set up with: the snapshot fails unless it has the same.
+    template <typename T>
+    void expect(const T& current) {
+        T data;
+        value(data);
+        if (!failed && data != current) {
+            failed = true;
+        }
+    }
+    // With required >= 0, the vector must have that many elements.
+    template <typename T>
+    void vector(std::vector<T>& data, long required = -1) {
+        unsigned long size = 0;
+        value(size);
+        if (failed || size > (unsigned long)(end - cursor) / sizeof(T) ||
+            (required >= 0 && size != (unsigned long)required)) {
+            failed = true;
+            return;
+        }
+        data.resize(size);
+        get(data.data(), size * sizeof(T));
+    }
+};
+
+int Snapshot::save(const char* filename, PageTable* pt, PhyFrames* ft, SwapDevice* swap, long traceOffset) {
+    SnapshotWriter out;
+    out.file = fopen(filename, "wb");
+    out.offset = 0;
+    if (!out.file) {
+        return -1;
+    }
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.version = SNAPSHOT_VERSION;
+    header.addrLength = ADDR_LENGTH;
+    header.pageOffsetBit = ADDR_PAGE_OFFSET_BIT;
+    header.maxFrames = MAX_FRAMES;
+    header.maxPages = MAX_PAGES;
+    header.traceOffset = traceOffset;
+    header.hasSwap = swap != NULL;
+    header.budgetMode = pt->_budgetMode;
+    header.hugeOrder = pt->_hugeOrder;
+    header.promote = pt->_promote;
+    out.value(header);
+
+    out.put(pt->_pt, MAX_PAGES * sizeof(PTE));
+    out.value(pt->_faults);
+    out.put(pt->_streams, sizeof(pt->_streams));
+    out.value(pt->_maxWindow);
+    out.value(pt->_prefetchIssued);
+    out.value(pt->_prefetchUseful);
+    out.value(pt->_prefetchWasted);
+    out.value(pt->_tau);
+    out.vector(pt->_windowPage);
+    out.vector(pt->_windowStamp);
+    out.value(pt->_lastFaultTimer);
+    out.vector(pt->_accessNext);
+    out.vector(pt->_accessPrev);
+    out.value(pt->_lastFaultTime);
+    out.value(pt->_clock);
+    out.value(pt->_interval);
+    out.vector(pt->_series);
+    out.vector(pt->_regionResident);
+    out.vector(pt->_regionHuge);
+    out.vector(pt->_blockHuge);
+    out.value(pt->_leafTables);
+    out.value(pt->_peakLeafTables);
+    out.value(pt->_promotions);
+    out.value(pt->_demotions);
+    if (pt->_hugeOrder > 0) {
+        for (Tlb* tlb : {pt->_smallTlb, pt->_hugeTlb}) {
+            out.value(tlb->_sets);
+            out.value(tlb->_ways);
+            out.vector(tlb->_tags);
+            out.vector(tlb->_next);
+            out.value(tlb->_hits);
+            out.value(tlb->_misses);
+        }
+    }
+
+    out.put(ft->_page, MAX_FRAMES * sizeof(Address8));
+    out.put(ft->_counter, MAX_FRAMES * sizeof(long));
+    out.put(ft->_nextUseOf, MAX_FRAMES * sizeof(long));
+    out.value(ft->_freeFramePointer);
+    out.vector(ft->_freeFrames);
+    out.value(ft->_resident);
+    out.value(ft->_budget);
+    out.value(ft->_globalTimer);
+    out.value(ft->_policy);
+    out.value(ft->_cleanWindow);
+    out.value(ft->_nextUse);
+
+    if (swap) {
+        out.value(swap->_readCost);
+        out.value(swap->_writeCost);
+        out.value(swap->_queueDepth);
+        out.value(swap->_now);
+        out.value(swap->_busyUntil);
+        out.vector(std::vector<double>(swap->_writeQueue.begin(), swap->_writeQueue.end()));
+        out.value(swap->_reads);
+        out.value(swap->_writes);
+        out.value(swap->_stallTime);
+    }
+    int result = ferror(out.file) ? -1 : 0;
+    fclose(out.file);
+
+    return result;
+}
+
+/**
+ * The swap device's state is restored into swap if both it and the snapshot have one; its costs stay
+ * those swap was made with. Return -1 if the file is not a snapshot of these sizes, modes and budget
+ * parameters, is cut short or is inconsistent, see consistent(); pt and ft are then in an undefined state.
+ */
+int Snapshot::restore(const char* filename, PageTable* pt, PhyFrames* ft, SwapDevice* swap, long* traceOffset) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (long)sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return -1;
+    }
+    SnapshotReader in;
+    in.cursor = (const unsigned char*)mapped;
+    in.end = in.cursor + info.st_size;
+    in.failed = false;
+    SnapshotHeader header;
+    in.value(header);
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, 4) != 0 || header.version != SNAPSHOT_VERSION ||
+        header.addrLength != ADDR_LENGTH || header.pageOffsetBit != ADDR_PAGE_OFFSET_BIT ||
+        header.maxFrames != MAX_FRAMES || header.maxPages != MAX_PAGES || header.budgetMode != pt->_budgetMode ||
+        header.hugeOrder != pt->_hugeOrder || header.promote != pt->_promote) {
+        munmap(mapped, info.st_size);
+        return -1;
+    }
+    *traceOffset = header.traceOffset;
+
+    // the modes come from the header; the budget parameters and array lengths must be those pt was set up with
+    in.get(pt->_pt, MAX_PAGES * sizeof(PTE));
+    in.value(pt->_faults);
+    in.get(pt->_streams, sizeof(pt->_streams));
+    in.value(pt->_maxWindow);
+    in.value(pt->_prefetchIssued);
+    in.value(pt->_prefetchUseful);
+    in.value(pt->_prefetchWasted);
+    in.expect(pt->_tau);
+    in.vector(pt->_windowPage, pt->_windowPage.size());
+    in.vector(pt->_windowStamp, pt->_windowStamp.size());
+    in.value(pt->_lastFaultTimer);
+    in.vector(pt->_accessNext, pt->_accessNext.size());
+    in.vector(pt->_accessPrev, pt->_accessPrev.size());
+    in.value(pt->_lastFaultTime);
+    in.value(pt->_clock);
+    in.expect(pt->_interval);
+    in.vector(pt->_series);
+    in.vector(pt->_regionResident, pt->_regionResident.size());
+    in.vector(pt->_regionHuge, pt->_regionHuge.size());
+    in.vector(pt->_blockHuge, pt->_blockHuge.size());
+    in.value(pt->_leafTables);
+    in.value(pt->_peakLeafTables);
+    in.value(pt->_promotions);
+    in.value(pt->_demotions);
+    if (pt->_hugeOrder > 0) {
+        for (Tlb* tlb : {pt->_smallTlb, pt->_hugeTlb}) {
+            in.expect(tlb->_sets);
+            in.expect(tlb->_ways);
+            in.vector(tlb->_tags, tlb->_tags.size());
+            in.vector(tlb->_next, tlb->_next.size());
+            in.value(tlb->_hits);
+            in.value(tlb->_misses);
+        }
+    }
+
+    in.get(ft->_page, MAX_FRAMES * sizeof(Address8));
+    in.get(ft->_counter, MAX_FRAMES * sizeof(long));
+    in.get(ft->_nextUseOf, MAX_FRAMES * sizeof(long));
+    in.value(ft->_freeFramePointer);
+    in.vector(ft->_freeFrames);
+    in.value(ft->_resident);
+    in.value(ft->_budget);
+    in.value(ft->_globalTimer);
+    in.value(ft->_policy);
+    in.value(ft->_cleanWindow);
+    in.value(ft->_nextUse);
+
+    if (header.hasSwap && swap) {
+        double readCost, writeCost;
+        int queueDepth;
+        std::vector<double> writeQueue;
+        in.value(readCost);
+        in.value(writeCost);
+        in.value(queueDepth);
+        in.value(swap->_now);
+        in.value(swap->_busyUntil);
+        in.vector(writeQueue);
+        swap->_writeQueue = std::deque<double>(writeQueue.begin(), writeQueue.end());
+        in.value(swap->_reads);
+        in.value(swap->_writes);
+        in.value(swap->_stallTime);
+    }
+    munmap(mapped, info.st_size);
+    if (in.failed || !consistent(pt, ft, header.hasSwap ? swap : NULL, header.traceOffset)) {
+        return -1;
+    }
+    ft->rebuildHeap();  // the OPT heap is not saved: it is the resident frames keyed by _nextUseOf
+
+    return 0;
+}
+
+/**
+ * Check what restore() read before anything indexes with it: every frame and page number is inside its
+ * array, the frames handed out are either free or hold a page whose entry maps back to them, and the
+ * readahead, working set, access list, huge page and TLB state agree with those. Counters can be no more
+ * than traceOffset accesses produce, each bringing in at most a frame's worth of pages, so they cannot
+ * overflow either.
+ */
+bool Snapshot::consistent(PageTable* pt, PhyFrames* ft, SwapDevice* swap, long traceOffset) {
+    if (traceOffset < 0 || traceOffset > NEVER_USED_AGAIN / MAX_FRAMES) {
+        return false;
+    }
+    long most = traceOffset * MAX_FRAMES;
+    auto counted = [](long count, long most) { return count >= 0 && count <= most; };
+    if (!counted(pt->_faults, traceOffset) || !counted(pt->_clock, traceOffset) ||
+        !counted(pt->_lastFaultTime, pt->_clock) || !counted(pt->_prefetchIssued, most) ||
+        !counted(pt->_prefetchUseful, most) || !counted(pt->_prefetchWasted, most) ||
+        !counted(pt->_promotions, most) || !counted(pt->_demotions, most) ||
+        !counted(pt->_peakLeafTables, MAX_PAGES) ||
+        ft->_globalTimer < 1 || ft->_globalTimer > traceOffset + 1 ||
+        (swap && (!counted(swap->_reads, most) || !counted(swap->_writes, most)))) {
+        return false;
+    }
+    if (pt->_hugeOrder > 0) {
+        for (Tlb* tlb : {pt->_smallTlb, pt->_hugeTlb}) {
+            if (!counted(tlb->_hits, traceOffset) || !counted(tlb->_misses, traceOffset)) {
+                return false;
+            }
+        }
+    }
+    // one sample every _interval accesses, none without a budget mode
+    if ((long)pt->_series.size() != (pt->_budgetMode == BUDGET_FIXED ? 0 : pt->_clock / pt->_interval)) {
+        return false;
+    }
+    for (size_t i = 0; i < pt->_series.size(); i++) {
+        const BudgetSample& sample = pt->_series[i];
+        if (sample.time != (long)(i + 1) * pt->_interval || sample.resident < 0 || sample.resident >= MAX_FRAMES ||
+            !counted(sample.faults, pt->_faults) || (i > 0 && sample.faults < pt->_series[i - 1].faults)) {
+            return false;
+        }
+    }
+
+    int handedOut = ft->_freeFramePointer;
+    if (handedOut < 1 || handedOut > MAX_FRAMES || ft->_budget < 1 || ft->_budget > MAX_FRAMES - 1 ||
+        ft->_cleanWindow < 1 ||
+        (ft->_policy != POLICY_LRU && ft->_policy != POLICY_OPT && ft->_policy != POLICY_CFLRU)) {
+        return false;
+    }
+    std::vector<char> isFree(handedOut, 0);
+    for (int frame : ft->_freeFrames) {
+        if (frame < 1 || frame >= handedOut || isFree[frame] || ft->_counter[frame] != NEVER_USED_AGAIN) {
+            return false;
+        }
+        isFree[frame] = 1;
+    }
+    int resident = 0;
+    for (int frame = 1; frame < handedOut; frame++) {
+        if (ft->_counter[frame] == NEVER_USED_AGAIN) {
+            if (!isFree[frame]) {
+                return false;
+            }
+            continue;
+        }
+        Address8 page = ft->_page[frame];
+        if (!counted(ft->_counter[frame], ft->_globalTimer - 1) || page >= (Address8)MAX_PAGES ||
+            !pt->_pt[page].valid || pt->_pt[page].frame != (Address8)frame) {
+            return false;
+        }
+        resident++;
+    }
+    // the resident frames map distinct pages, so no other entry may be valid
+    std::vector<int> regionResident(pt->_regionResident.size(), 0);
+    int valid = 0;
+    for (long page = 0; page < MAX_PAGES; page++) {
+        if (pt->_pt[page].valid) {
+            valid++;
+            if (pt->_hugeOrder > 0) {
+                regionResident[page >> pt->_hugeOrder]++;
+            }
+        }
+    }
+    if (resident != ft->_resident || valid != resident) {
+        return false;
+    }
+
+    for (const PrefetchStream& stream : pt->_streams) {
+        if (stream.lastPage == -1) {
+            continue;  // unused slot, the rest is not set
+        }
+        unsigned char active;  // a bool from the file may hold any byte: look at it as one
+        memcpy(&active, &stream.active, 1);
+        if (stream.lastPage < 0 || stream.lastPage >= MAX_PAGES || stream.window < 0 ||
+            stream.window > (MAX_FRAMES - 1) / 2 || stream.stride <= -MAX_PAGES || stream.stride >= MAX_PAGES ||
+            active > 1 || (active && stream.stride == 0) || !counted(stream.hits, traceOffset) ||
+            stream.hits == INT_MAX) {
+            return false;
+        }
+    }
+    for (Address8 page : pt->_windowPage) {
+        if (page >= (Address8)MAX_PAGES) {
+            return false;
+        }
+    }
+    if (pt->_budgetMode == BUDGET_PFF) {
+        // a circular list through frame 0 of resident frames only, prev and next pointing at each other
+        int linked = 0;
+        for (int frame = 0; frame < MAX_FRAMES; frame++) {
+            int next = pt->_accessNext[frame];
+            int prev = pt->_accessPrev[frame];
+            if (next < 0 && prev < 0 && frame != 0) {
+                continue;
+            }
+            if (next < 0 || prev < 0 || next >= MAX_FRAMES || prev >= MAX_FRAMES ||
+                pt->_accessPrev[next] != frame ||
+                (frame != 0 && (frame >= handedOut || ft->_counter[frame] == NEVER_USED_AGAIN))) {
+                return false;
+            }
+            linked++;
+        }
+        int steps = 1;
+        for (int frame = pt->_accessNext[0]; frame != 0 && steps <= linked; frame = pt->_accessNext[frame]) {
+            steps++;
+        }
+        if (steps != linked) {
+            return false;
+        }
+    }
+    long leafTables = 0;  // regions with resident pages that are not huge
+    if (pt->_hugeOrder > 0) {
+        long pages = 1L << pt->_hugeOrder;
+        for (size_t region = 0; region < regionResident.size(); region++) {
+            if (pt->_regionResident[region] != regionResident[region]) {
+                return false;
+            }
+            if (!pt->_regionHuge[region]) {
+                leafTables += regionResident[region] > 0;
+                continue;
+            }
+            // a huge region is all resident, in order, in a block marked as backing one
+            long first = region << pt->_hugeOrder;
+            long block = pt->_pt[first].frame >> pt->_hugeOrder;
+            if (regionResident[region] != pages || block < 1 || block >= (long)pt->_blockHuge.size() ||
+                !pt->_blockHuge[block]) {
+                return false;
+            }
+            for (long i = 0; i < pages; i++) {
+                if (pt->_pt[first + i].frame != (Address8)((block << pt->_hugeOrder) + i)) {
+                    return false;
+                }
+            }
+        }
+        for (Tlb* tlb : {pt->_smallTlb, pt->_hugeTlb}) {
+            for (int next : tlb->_next) {
+                if (next < 0 || next >= tlb->_ways) {
+                    return false;
+                }
+            }
+        }
+    }
+    if (pt->_leafTables != leafTables || pt->_peakLeafTables < leafTables) {
+        return false;
+    }
+
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef snapshot_h_
+#define snapshot_h_
+
+#include "mm2types.h"
+#include "pagetable.h"
+#include "phyframes.h"
+#include "swapdevice.h"
+
+#define SNAPSHOT_MAGIC "MMCK"
+#define SNAPSHOT_VERSION 3
+
+struct SnapshotHeader {
+    char magic[4];
+    int version;
+    int addrLength;  // the sizes must be the same to restore
+    int pageOffsetBit;
+    int maxFrames;
+    int maxPages;
+    long traceOffset;  // index of the next address to translate
+    int hasSwap;
+    int budgetMode;  // the modes must be the same as well
+    int hugeOrder;
+    int promote;
+};
+
+/**
+ * Saves the whole state of a PageTable and its PhyFrames, with the swap device if any, and the trace offset.
+ * The file is the header followed by every field and array in a fixed order, each padded to 8 bytes,
+ * so restoring maps it and copies the arrays straight out of it.
+ * Restoring needs a PageTable and PhyFrames made for the same sizes, with the same budget and huge page
+ * modes enabled with the same parameters. Everything else, policy included, is overwritten by the snapshot.
+ */
+class Snapshot {
+   private:
+    static bool consistent(PageTable* pt, PhyFrames* ft, SwapDevice* swap, long traceOffset);
+
+   public:
+    static int save(const char* filename, PageTable* pt, PhyFrames* ft, SwapDevice* swap, long traceOffset);
+    static int restore(const char* filename, PageTable* pt, PhyFrames* ft, SwapDevice* swap, long* traceOffset);
+};
+
+#endif
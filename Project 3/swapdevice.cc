@@ -0,0 +1,87 @@
+#include "swapdevice.h"
+
+SwapDevice::SwapDevice(double readCost, double writeCost, int queueDepth) {
+    _readCost = readCost;
+    _writeCost = writeCost;
+    _queueDepth = queueDepth < 1 ? 1 : queueDepth;
+    _now = 0;
+    _busyUntil = 0;
+    _reads = 0;
+    _writes = 0;
+    _stallTime = 0;
+}
+
+/**
+ * Forget write-backs that are done by now.
+ */
+void SwapDevice::retire() {
+    while (!_writeQueue.empty() && _writeQueue.front() <= _now) {
+        _writeQueue.pop_front();
+    }
+}
+
+void SwapDevice::stallUntil(double time) {
+    if (time > _now) {
+        _stallTime += time - _now;
+        _now = time;
+    }
+}
+
+/**
+ * Advance the clock by work that does not touch the device.
+ */
+void SwapDevice::tick(double time) {
+    _now += time;
+}
+
+/**
+ * Page-in: starts after whatever the device is busy with, and the access waits for it.
+ */
+void SwapDevice::read() {
+    retire();
+    double start = _busyUntil > _now ? _busyUntil : _now;
+    _busyUntil = start + _readCost;
+    stallUntil(_busyUntil);
+    _reads++;
+}
+
+/**
+ * Queue the write-back of a dirty victim. Stalls only while the queue is full.
+ */
+void SwapDevice::writeBack() {
+    retire();
+    if ((int)_writeQueue.size() >= _queueDepth) {
+        stallUntil(_writeQueue.front());
+        retire();
+    }
+    double start = _busyUntil > _now ? _busyUntil : _now;
+    _busyUntil = start + _writeCost;
+    _writeQueue.push_back(_busyUntil);
+    _writes++;
+}
+
+/**
+ * Wait for every queued write-back, e.g. at the end of the simulation.
+ */
+void SwapDevice::flush() {
+    if (!_writeQueue.empty()) {
+        stallUntil(_writeQueue.back());
+    }
+    retire();
+}
+
+long SwapDevice::reads() {
+    return _reads;
+}
+
+long SwapDevice::writes() {
+    return _writes;
+}
+
+double SwapDevice::stallTime() {
+    return _stallTime;
+}
+
+double SwapDevice::now() {
+    return _now;
+}
\ No newline at end of file
@@ -0,0 +1,41 @@
+#ifndef swapdevice_h_
+#define swapdevice_h_
+
+#include <deque>
+
+/**
+ * Simulated backing store. Time is counted in units where one memory access costs 1.
+ * Page-ins are synchronous: the faulting access stalls until the read is done. Write-backs of
+ * dirty victims are queued and done in the background, stalling only when the queue is full.
+ * The device serves reads and writes one at a time, in order.
+ */
+class SwapDevice {
+   friend class Snapshot;
+
+   private:
+    double _readCost;
+    double _writeCost;
+    int _queueDepth;
+    double _now;
+    double _busyUntil;               // when the device finishes everything it was given
+    std::deque<double> _writeQueue;  // completion times of queued write-backs
+    long _reads;
+    long _writes;
+    double _stallTime;
+
+    void retire();
+    void stallUntil(double time);
+
+   public:
+    SwapDevice(double readCost, double writeCost, int queueDepth);
+    void tick(double time);
+    void read();
+    void writeBack();
+    void flush();
+    long reads();
+    long writes();
+    double stallTime();
+    double now();
+};
+
+#endif
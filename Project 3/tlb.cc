@@ -0,0 +1,59 @@
+#include "tlb.h"
+
+Tlb::Tlb(int entries, int ways) {
+    _ways = ways < 1 ? 1 : ways;
+    _sets = entries / _ways < 1 ? 1 : entries / _ways;
+    _tags.assign(_sets * _ways, -1);
+    _next.assign(_sets, 0);
+    _hits = 0;
+    _misses = 0;
+}
+
+/**
+ * Return true on a hit. A miss fills the entry, as after a page walk.
+ */
+bool Tlb::lookup(long tag) {
+    long* set = &_tags[(tag % _sets) * _ways];
+    for (int i = 0; i < _ways; i++) {
+        if (set[i] == tag) {
+            _hits++;
+            return true;
+        }
+    }
+    _misses++;
+    int& next = _next[tag % _sets];
+    set[next] = tag;
+    next = (next + 1) % _ways;
+
+    return false;
+}
+
+void Tlb::invalidate(long tag) {
+    long* set = &_tags[(tag % _sets) * _ways];
+    for (int i = 0; i < _ways; i++) {
+        if (set[i] == tag) {
+            set[i] = -1;
+        }
+    }
+}
+
+/**
+ * Entries in use.
+ */
+int Tlb::valid() {
+    int count = 0;
+    for (long tag : _tags) {
+        if (tag != -1) {
+            count++;
+        }
+    }
+    return count;
+}
+
+long Tlb::hits() {
+    return _hits;
+}
+
+long Tlb::misses() {
+    return _misses;
+}
\ No newline at end of file
@@ -0,0 +1,31 @@
+#ifndef tlb_h_
+#define tlb_h_
+
+#include <vector>
+
+/**
+ * Software TLB for statistics: set associative, round robin within a set. A tag is whatever the owner
+ * translates with one entry, a small page number or a huge region number. It does not change translation;
+ * the owner must invalidate a tag when its mapping goes away.
+ */
+class Tlb {
+   friend class Snapshot;
+
+   private:
+    int _sets;
+    int _ways;
+    std::vector<long> _tags;  // _sets x _ways, -1 if empty
+    std::vector<int> _next;   // per set: way replaced next
+    long _hits;
+    long _misses;
+
+   public:
+    Tlb(int entries, int ways);
+    bool lookup(long tag);
+    void invalidate(long tag);
+    int valid();
+    long hits();
+    long misses();
+};
+
+#endif
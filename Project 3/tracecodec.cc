@@ -0,0 +1,233 @@
+#include "tracecodec.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+TraceEncoder::TraceEncoder() {
+    _file = NULL;
+    _blockSize = TRACE_BLOCK_SIZE;
+    _count = 0;
+    _offset = 0;
+    _previous = 0;
+}
+
+int TraceEncoder::open(const char* filename, unsigned int blockSize) {
+    if (blockSize == 0) {
+        return -1;
+    }
+    _file = fopen(filename, "wb");
+    if (!_file) {
+        return -1;
+    }
+    _blockSize = blockSize;
+    // the header is written again by close(), once the counts are known
+    TraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, _file);
+    _offset = sizeof(header);
+
+    return 0;
+}
+
+int TraceEncoder::write(Address8 address) {
+    if (_count % _blockSize == 0) {
+        _index.push_back(_offset);
+        _previous = 0;
+    }
+    long delta = (long)(address - _previous);
+    Address8 zigzag = ((Address8)delta << 1) ^ (Address8)(delta >> 63);
+    unsigned char bytes[10];
+    int length = 0;
+    while (zigzag >= 0x80) {
+        bytes[length++] = (unsigned char)(zigzag | 0x80);
+        zigzag >>= 7;
+    }
+    bytes[length++] = (unsigned char)zigzag;
+    fwrite(bytes, 1, length, _file);
+    _offset += length;
+    _previous = address;
+    _count++;
+
+    return 0;
+}
+
+int TraceEncoder::close() {
+    if (!_file) {
+        return -1;
+    }
+    TraceFileHeader header;
+    memcpy(header.magic, TRACE_MAGIC, 4);
+    header.blockSize = _blockSize;
+    header.count = _count;
+    header.blocks = _index.size();
+    header.indexOffset = _offset;
+    if (!_index.empty()) {
+        fwrite(&_index[0], sizeof(unsigned long), _index.size(), _file);
+    }
+    fseek(_file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, _file);
+    int result = ferror(_file) ? -1 : 0;
+    fclose(_file);
+    _file = NULL;
+
+    return result;
+}
+
+TraceDecoder::TraceDecoder() {
+    _file = NULL;
+    _mappedSize = 0;
+    memset(&_header, 0, sizeof(_header));
+    _index = NULL;
+    _cursor = NULL;
+    _blockEnd = NULL;
+    _position = 0;
+    _previous = 0;
+    _corrupt = false;
+}
+
+TraceDecoder::~TraceDecoder() {
+    if (_file) {
+        munmap((void*)_file, _mappedSize);
+    }
+}
+
+/**
+ * Return -1 if filename cannot be read or is not a compressed trace, -2 if it has the magic of one but is
+ * corrupt: a count that does not match the blocks, or an index or block offset outside the file.
+ */
+int TraceDecoder::open(const char* filename) {
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (long)sizeof(TraceFileHeader)) {
+        close(fd);
+        return -1;
+    }
+    void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return -1;
+    }
+    memcpy(&_header, mapped, sizeof(_header));
+    unsigned long size = info.st_size;
+    // every address takes at least one byte, and every block but the last holds blockSize of them
+    if (memcmp(_header.magic, TRACE_MAGIC, 4) != 0) {
+        munmap(mapped, info.st_size);
+        return -1;
+    }
+    bool valid = _header.blockSize != 0 &&
+                 _header.indexOffset >= sizeof(TraceFileHeader) && _header.indexOffset <= size &&
+                 _header.blocks <= (size - _header.indexOffset) / sizeof(unsigned long) &&
+                 _header.count <= _header.indexOffset - sizeof(TraceFileHeader) &&
+                 _header.blocks == _header.count / _header.blockSize + (_header.count % _header.blockSize != 0);
+    unsigned long previous = sizeof(TraceFileHeader);
+    for (unsigned long i = 0; valid && i < _header.blocks; i++) {
+        unsigned long offset;
+        memcpy(&offset, (const unsigned char*)mapped + _header.indexOffset + i * sizeof(unsigned long), sizeof(offset));
+        valid = offset >= previous && offset <= _header.indexOffset;
+        previous = offset;
+    }
+    if (!valid) {
+        munmap(mapped, info.st_size);
+        return -2;
+    }
+    madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+    _file = (const unsigned char*)mapped;
+    _mappedSize = info.st_size;
+    _index = _file + _header.indexOffset;
+
+    return seek(0);
+}
+
+unsigned long TraceDecoder::blockOffset(long block) {
+    unsigned long offset;
+    memcpy(&offset, _index + block * sizeof(unsigned long), sizeof(offset));
+    return offset;
+}
+
+long TraceDecoder::length() {
+    return _header.count;
+}
+
+long TraceDecoder::position() {
+    return _position;
+}
+
+/**
+ * Decode up to max addresses into out. Return how many, 0 at the end of the trace, -1 if a block is
+ * corrupt: a varint that runs past the end of its block or is longer than 64 bits.
+ */
+long TraceDecoder::read(Address8* out, long max) {
+    if (_corrupt) {
+        return -1;
+    }
+    long n = 0;
+    const unsigned char* cursor = _cursor;
+    const unsigned char* blockEnd = _blockEnd;
+    Address8 previous = _previous;
+    while (n < max && _position + n < (long)_header.count) {
+        if ((_position + n) % _header.blockSize == 0) {
+            long block = (_position + n) / _header.blockSize;
+            cursor = _file + blockOffset(block);
+            blockEnd = _file + (block + 1 < (long)_header.blocks ? blockOffset(block + 1) : _header.indexOffset);
+            previous = 0;
+        }
+        if (cursor == blockEnd) {
+            _corrupt = true;
+            return -1;
+        }
+        Address8 zigzag = *cursor++;
+        if (zigzag >= 0x80) {
+            // more than one byte
+            zigzag &= 0x7f;
+            int shift = 7;
+            unsigned char byte;
+            do {
+                if (cursor == blockEnd || shift > 63) {
+                    _corrupt = true;
+                    return -1;
+                }
+                byte = *cursor++;
+                zigzag |= (Address8)(byte & 0x7f) << shift;
+                shift += 7;
+            } while (byte >= 0x80);
+        }
+        previous += (zigzag >> 1) ^ -(zigzag & 1);
+        out[n++] = previous;
+    }
+    _cursor = cursor;
+    _blockEnd = blockEnd;
+    _previous = previous;
+    _position += n;
+
+    return n;
+}
+
+/**
+ * Continue decoding at the address of index position: jump to its block through the index, then skip.
+ */
+int TraceDecoder::seek(long position) {
+    if (_corrupt || position < 0 || position > (long)_header.count) {
+        return -1;
+    }
+    long block = position / _header.blockSize;
+    _position = block * _header.blockSize;
+    _cursor = block < (long)_header.blocks ? _file + blockOffset(block) : _file + _header.indexOffset;
+    _blockEnd = _cursor;  // read() sets it on entering the block
+    _previous = 0;
+    Address8 skipped[256];
+    while (_position < position) {
+        long step = position - _position < 256 ? position - _position : 256;
+        if (read(skipped, step) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
\ No newline at end of file
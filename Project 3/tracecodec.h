@@ -0,0 +1,74 @@
+#ifndef tracecodec_h_
+#define tracecodec_h_
+
+#include <cstdio>
+#include <vector>
+
+#include "mm2types.h"
+
+#define TRACE_MAGIC "MMTZ"
+#define TRACE_BLOCK_SIZE 65536  // addresses per block by default
+
+/**
+ * Compressed trace file:
+ *   header (TraceFileHeader)
+ *   blocks: every address as the zigzag varint of its difference to the previous one. Each block starts
+ *           again from 0, so that it can be decoded on its own.
+ *   index:  byte offset of every block, blocks x 8 bytes
+ * Only 8-byte addresses are stored. Traces with few jumps take 1 or 2 bytes per address.
+ */
+struct TraceFileHeader {
+    char magic[4];
+    unsigned int blockSize;
+    unsigned long count;        // addresses in the trace
+    unsigned long blocks;
+    unsigned long indexOffset;  // byte offset of the block index
+};
+
+/**
+ * Writes a compressed trace, address by address.
+ */
+class TraceEncoder {
+   private:
+    FILE* _file;
+    unsigned int _blockSize;
+    unsigned long _count;
+    unsigned long _offset;  // bytes written so far
+    Address8 _previous;
+    std::vector<unsigned long> _index;
+
+   public:
+    TraceEncoder();
+    int open(const char* filename, unsigned int blockSize = TRACE_BLOCK_SIZE);
+    int write(Address8 address);
+    int close();
+};
+
+/**
+ * Streams addresses out of a compressed trace mapped into memory, a batch at a time.
+ */
+class TraceDecoder {
+   private:
+    const unsigned char* _file;
+    long _mappedSize;
+    TraceFileHeader _header;
+    const unsigned char* _index;     // not aligned: the index starts right after the last block
+    const unsigned char* _cursor;    // next byte to decode
+    const unsigned char* _blockEnd;  // first byte past the block of _cursor
+    long _position;                  // index of the next address
+    Address8 _previous;
+    bool _corrupt;                   // a block ran past its end, read() and seek() fail from then on
+
+    unsigned long blockOffset(long block);
+
+   public:
+    TraceDecoder();
+    ~TraceDecoder();
+    int open(const char* filename);
+    long length();
+    long position();
+    long read(Address8* out, long max);
+    int seek(long position);
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "mm2types.h"
+#include "tracecodec.h"
+#include "tracereader.h"
+
+int ADDR_LENGTH = 8;
+int ADDR_PAGE_OFFSET_BIT = 7;
+int MAX_FRAMES = 8;
+int MAX_PAGES = 32;
+
+#define BATCH 4096
+
+/**
+ * usage: traceconv compress rawfile compressedfile [blocksize]
+ *        traceconv decompress compressedfile rawfile
+ * Converts between raw traces of 8-byte addresses and the compressed format of tracecodec.h.
+ */
+int main(int argc, char** argv) {
+    if (argc != 4 && argc != 5) {
+        ERROR_RETURN;
+    }
+    std::string command = argv[1];
+
+    if (command == "compress") {
+        TraceReader trace;
+        TraceEncoder encoder;
+        unsigned int blockSize = argc == 5 ? std::atoi(argv[4]) : TRACE_BLOCK_SIZE;
+        if (trace.open(argv[2]) != 0 || encoder.open(argv[3], blockSize) != 0) {
+            ERROR_RETURN;
+        }
+        for (long i = 0; i < trace.length(); i++) {
+            encoder.write(trace.at(i));
+        }
+        if (encoder.close() != 0) {
+            ERROR_RETURN;
+        }
+        std::ifstream compressed(argv[3], std::ios::binary | std::ios::ate);
+        long size = compressed.tellg();
+        std::cout << "addresses " << trace.length() << " raw " << trace.length() * sizeof(Address8) << " bytes compressed "
+                  << size << " bytes" << std::endl;
+    } else if (command == "decompress" && argc == 4) {
+        TraceDecoder decoder;
+        std::ofstream fileout(argv[3], std::ios::binary | std::ios::out);
+        if (decoder.open(argv[2]) != 0 || !fileout) {
+            ERROR_RETURN;
+        }
+        Address8 batch[BATCH];
+        long n;
+        double seconds = 0;
+        while (true) {
+            auto start = std::chrono::steady_clock::now();
+            n = decoder.read(batch, BATCH);
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (n <= 0) {
+                break;
+            }
+            fileout.write((char*)batch, n * sizeof(Address8));
+        }
+        if (n < 0) {
+            std::cerr << "corrupt trace " << argv[2] << std::endl;
+            ERROR_RETURN;
+        }
+        std::cout << "addresses " << decoder.length() << " decoded at "
+                  << (long)(seconds > 0 ? decoder.length() / seconds : 0) << " addresses/s" << std::endl;
+    } else {
+        ERROR_RETURN;
+    }
+
+    return 0;
+}
\ No newline at end of file
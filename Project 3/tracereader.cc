@@ -0,0 +1,69 @@
+#include "tracereader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+TraceReader::TraceReader() {
+    _trace = NULL;
+    _addrLength = sizeof(Address8);
+    _length = 0;
+    _mappedSize = 0;
+}
+
+TraceReader::~TraceReader() {
+    if (_trace) {
+        munmap((void*)_trace, _mappedSize);
+    }
+}
+
+int TraceReader::open(const char* filename, int addrLength) {
+    if (addrLength != sizeof(Address8) && addrLength != sizeof(unsigned int)) {
+        return -1;
+    }
+    _addrLength = addrLength;
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return -1;
+    }
+    _length = info.st_size / _addrLength;
+    if (_length == 0) {
+        close(fd);
+        return 0;  // empty trace, nothing to map
+    }
+    void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        _length = 0;
+        return -1;
+    }
+    madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+    _trace = mapped;
+    _mappedSize = info.st_size;
+
+    return 0;
+}
+
+long TraceReader::length() {
+    return _length;
+}
+
+Address8 TraceReader::at(long index) {
+    if (_addrLength == sizeof(Address8)) {
+        return ((const Address8*)_trace)[index];
+    }
+    return ((const unsigned int*)_trace)[index];
+}
+
+/**
+ * The addresses themselves, for loops that know the address width at compile time.
+ */
+const void* TraceReader::data() {
+    return _trace;
+}
@@ -0,0 +1,26 @@
+#ifndef tracereader_h_
+#define tracereader_h_
+
+#include "mm2types.h"
+
+/**
+ * Read-only view of a raw trace file (little-endian addresses of 8 bytes, or 4 bytes), mapped into memory.
+ * A trailing partial address is ignored, as reading the file address by address would do.
+ */
+class TraceReader {
+   private:
+    const void* _trace;
+    int _addrLength;  // bytes per address
+    long _length;     // number of addresses
+    long _mappedSize;
+
+   public:
+    TraceReader();
+    ~TraceReader();
+    int open(const char* filename, int addrLength = sizeof(Address8));
+    long length();
+    Address8 at(long index);
+    const void* data();
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef translate_h_
+#define translate_h_
+
+#include "mm2types.h"
+#include "pagetable.h"
+
+typedef unsigned int Address4;  // record of a trace with 4-byte addresses
+
+/**
+ * Virtual to physical translation with the page size and the address width known at compile time, so
+ * that every shift and mask is a constant. ADDRESS is the type of one trace record, whose top bit marks
+ * a write (ADDR_WRITE_BIT for Address8). PAGE_SHIFT = -1 takes the shift from ADDR_PAGE_OFFSET_BIT
+ * at run time, for page sizes without an instantiation of their own.
+ */
+template <int PAGE_SHIFT, typename ADDRESS>
+inline ADDRESS translateAddress(ADDRESS addrVirtual, PageTable* pt) {
+    const ADDRESS WRITE_BIT = (ADDRESS)1 << (sizeof(ADDRESS) * 8 - 1);
+    bool isWrite = addrVirtual & WRITE_BIT;
+    addrVirtual &= ~WRITE_BIT;
+    if constexpr (PAGE_SHIFT < 0) {
+        int pageShift = ADDR_PAGE_OFFSET_BIT;
+        ADDRESS frame = pt->map(addrVirtual >> pageShift, isWrite);
+        return frame << pageShift | (addrVirtual & (((ADDRESS)1 << pageShift) - 1));
+    } else {
+        const ADDRESS OFFSET_MASK = ((ADDRESS)1 << PAGE_SHIFT) - 1;
+        ADDRESS frame = pt->map(addrVirtual >> PAGE_SHIFT, isWrite);
+        return frame << PAGE_SHIFT | (addrVirtual & OFFSET_MASK);
+    }
+}
+
+#endif